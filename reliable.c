@@ -14,77 +14,545 @@
 #include <netinet/in.h>
 #include <stdbool.h>
 #include "rlib.h"
+#include "trace.h"
 
 #define PACKET_HEADER_LENGTH 12
 #define ACK_HEADER_LENGTH    8
 #define DATA_LEN             500
+#define MIN_RTO              10   /* floor on the adaptive timeout, in ms */
+#define DELIVER_IOV          64   /* payloads per conn_outputv */
+#define MAX_PAYLOAD          (DATA_LEN-1) /* most rel_read puts in a packet */
+#define PMTU_TRIES           3    /* probes of one size before giving up on it */
+#define PMTU_STEP            32   /* search until good and bad are this close */
 
-void send_packet(rel_t *s);
+void send_packet(rel_t *s, packet_t *pkt);
 
 
+typedef struct _buffered {
+    int len;                //payload bytes, 0 for an EOF
+    packet_t *pkt;          //held (pkt_hold), payload still in pkt->data
+} buffered;
+
 typedef struct _receiver {
-    int len;
+    int window;             //# of seqnos past last_seqno_processed we buffer
     int last_seqno_processed; //recieved packets accepted
-    char data[DATA_LEN];
+    bool eof_delivered;     //conn_output has been handed the EOF
+    uint32_t *present;      //occupancy bitmap, bit seqno % window
+    buffered *ring;         //out-of-order packets, indexed by seqno % window
+    int ack_every;          //ack after this many in-order packets...
+    int ack_delay;          //...or once the oldest unacked is this many ms old
+    int unacked;            //in-order packets delivered since our last ack
+    struct timer ack_timer; //sends the ack ack_delay ms after the first of those
 } receiver;
 
+typedef struct _slot {
+    packet_t *packet;       //in network byte order, checksummed
+    uint64_t sent;          //timer_now_us() of the last (re)transmission
+    int rto;                //current timeout for this packet in ms
+    bool retransmitted;     //Karn: never take an RTT sample from these
+    bool sacked;            //peer's SACK says it has this one already
+    bool deferred;          //its timeout was held back to a later tick
+    struct timer rtx;       //pending while unacked: goes off after rto
+    rel_t *r;               //whose slot this is, for rtx
+} slot;
+
+void resend(rel_t *r, slot *sl);
+void send_slot(rel_t *s, slot *sl);
+
+typedef struct _rtt_estimator {
+    long srtt;              //smoothed RTT in microseconds, 0 until sampled
+    long rttvar;            //RTT variation in microseconds
+    int rto;                //timeout given to newly sent packets, in ms
+    int max_rto;            //-t: the initial and the largest timeout
+    int min_rto;            //MIN_RTO, plus however long the peer says it sits on an ack
+} rtt_estimator;
+
+//congestion control: the sender asks cwnd how much it may have in flight,
+//and tells the algorithm about acks, losses, timeouts and RTT samples
+typedef struct _congestion_ops {
+    void (*on_ack)(rel_t *r, int newly_acked);
+    void (*on_loss)(rel_t *r);      //fast retransmit fired
+    void (*on_timeout)(rel_t *r);   //a retransmission timer expired
+    void (*on_rtt_sample)(rel_t *r, long rtt);
+} congestion_ops;
+
+typedef struct _congestion {
+    const congestion_ops *ops;  //NULL: just use the static window
+    int cwnd;               //congestion window in packets
+    int ssthresh;           //slow start below this
+    int acked_cnt;          //acks counted towards the next cwnd++
+    bool in_recovery;       //NewReno fast recovery
+    int recover;            //highest seqno sent when the loss was seen
+    long base_rtt;          //Vegas: smallest RTT seen, in microseconds
+    long round_rtt;         //Vegas: smallest RTT this round
+    int round_end;          //Vegas: the round ends once this is acked
+} congestion;
+
 typedef struct _sender {
-    int last_seqno_sent; //sent packets accepted
-    bool is_empty;
-    packet_t packet;
-    
+    int window;             //max # of unacknowledged packets in flight
+    int next_seqno;         //seqno the next packet read will get
+    int last_seqno_acked;   //everything up to here has been acked
+    bool eof_sent;          //conn_input returned -1 and EOF is queued
+    int dupacks;            //pure acks seen repeating last_seqno_acked+1
+    int dupack_threshold;   //fast retransmit after this many, 0 = never
+    int held;               //Nagle: payload bytes waiting in next_seqno's slot
+    int small_seqno;        //last short packet sent; hold others until acked
+    bool nodelay;           //send short packets right away
+    int max_payload;        //most rel_read puts in a packet now
+    slot *ring;             //in-flight packets, indexed by seqno % window
+    char *bufs;             //their packets, stride bytes apart
+    int stride;
 } sender;
 
+//searching for the largest packet the path delivers (see rlib.h).  The
+//answer lies in [good, bad).
+typedef struct _pmtu {
+    int max_packet;         //-m: the most we send or accept
+    int peer_max;           //the most the peer accepts, 0 until it says
+    int good;               //largest packet known to get through
+    int bad;                //smallest given up on; past the limit at first
+    int probe;              //size of the probe out, 0 if none
+    int tries;              //times that probe has been sent
+    int answer;             //probe_ack for the next ack we send
+    char *buf;              //the probe, while searching
+    struct timer timer;     //resends the probe, or gives up on its size
+} pmtu;
+
+//closing works like TCP's, with each side's EOF as its FIN
+typedef enum _close_state {
+    OPEN,                   //no EOF either way yet
+    EOF_SENT,               //our input has ended; the peer's hasn't
+    EOF_RECEIVED,           //the peer's EOF is delivered; our input hasn't ended
+    CLOSING,                //both EOFs; waiting for ours to be acked
+    LINGER,                 //done, but the peer may not have our last ack
+} close_state;
+
 struct reliable_state {
     rel_t *next;            /* Linked list for traversing all connections */
     rel_t **prev;
     conn_t *c;          /* This is the connection object */
     /* Add your own data fields below this */
-    bool end_connection;
+    close_state state;
+    int eof_acked_from;     /* every packet from this seqno on acks the peer's EOF */
+    struct timer linger;    /* in LINGER: destroys the connection */
+    pmtu pmtu;
     sender send;
     receiver recv;
-    bool kill_all;
+    rtt_estimator rtt;
+    congestion cong;
+    bool sack;              /* Send and act on SACK trailers */
+    struct sockaddr_storage peer; /* Server only: key in rel_table */
+    unsigned int hash;      /* addrhash (&peer) */
+    bool in_table;
+    struct rel_stats stats; /* counters; window and srtt filled in by rel_stats */
+    int tick;               /* -> timer: retry interval for held back resends */
+    uint64_t timeout_round; /* timer_now() of the last on_timeout */
+    uint64_t resend_tick;   /* timer_now() timeout_resent counts for */
+    int timeout_resent;     /* packets resent by timeout in that tick */
 };
-rel_t *rel_list;
+__thread rel_t *rel_list;
 
-void myPrintPacket(char* func_name, int hex, packet_t* packet) {
-    char* fstring;
-    if (!hex) fstring = "cksum:%d, len:%d, ackno:%d, seqno:%d, %s_data: %s";
-    if (hex)  fstring = "cksum:%x, len:%d, ackno:%x, seqno:%x, %s_data: %s";
-    
-    fprintf(stderr, fstring,
-            packet->cksum,
-            packet->len,
-            packet->ackno,
-            packet->seqno,
-            func_name,
-            packet->data);
-}
+//server connections by peer address: open addressing with linear
+//probing.  Growing moves a few slots from the old array on every call
+//instead of rehashing everything at once.
+typedef struct _rel_table {
+    rel_t **slots;          //NULL if empty, &table_tombstone if deleted
+    int size;               //power of 2
+    int used;               //live entries plus tombstones
+    rel_t **old;            //array being migrated away from, or NULL
+    int old_size;
+    int migrate_pos;        //next slot of old to move
+} rel_table;
+
+#define TABLE_MIN_SIZE      64
+#define TABLE_MIGRATE_STEP  16   /* old slots moved per table operation */
 
-void init_receiver(receiver* r) {
-    r->len = 0;
+__thread rel_table rel_by_addr;
+rel_t table_tombstone;
+
+void ack_expired(struct timer *t);
+void linger_expired(struct timer *t);
+void probe_expired(struct timer *t);
+void pmtu_done(rel_t *r);
+
+void init_receiver(receiver* r, int window, int ack_every, int ack_delay) {
+    int words = (window + 31) / 32;
+    r->window = window;
+    //a window's worth is all the sender can have unacked; waiting for
+    //more would hold every ack for the whole ack_delay
+    r->ack_every = ack_every < window ? ack_every : window;
+    r->ack_delay = ack_delay;
+    r->unacked = 0;
     r->last_seqno_processed = 0;
+    r->eof_delivered = false;
+    r->present = slab_alloc(words * sizeof(uint32_t));
+    memset(r->present, 0, words * sizeof(uint32_t));
+    r->ring = slab_alloc(window * sizeof(buffered));
+    timer_init(&r->ack_timer, ack_expired);
+}
+
+bool is_present(const receiver* r, int seqno) {
+    int i = seqno % r->window;
+    return r->present[i / 32] & (1u << (i % 32));
+}
+
+void set_present(receiver* r, int seqno, bool on) {
+    int i = seqno % r->window;
+    if (on)
+        r->present[i / 32] |= 1u << (i % 32);
+    else
+        r->present[i / 32] &= ~(1u << (i % 32));
+}
+
+//gives back the packets still waiting to be delivered
+void free_receiver(receiver* r) {
+    int seqno;
+    for (seqno = r->last_seqno_processed + 1;
+         seqno <= r->last_seqno_processed + r->window; seqno++)
+        if (is_present(r, seqno))
+            pkt_release(r->ring[seqno % r->window].pkt);
+    timer_cancel(&r->ack_timer);
+    slab_free(r->present, (r->window + 31) / 32 * sizeof(uint32_t));
+    slab_free(r->ring, r->window * sizeof(buffered));
+}
+
+void rtx_expired(struct timer *t);
+
+void init_sender(rel_t *r, sender* s, int window, int dupack_threshold,
+                 bool nodelay, int max_packet) {
+    int i;
+    s->window = window;
+    s->held = 0;
+    s->small_seqno = 0;
+    s->nodelay = nodelay;
+    s->dupacks = 0;
+    s->dupack_threshold = dupack_threshold;
+    s->next_seqno = 1;
+    s->last_seqno_acked = 0;
+    s->eof_sent = false;
+    s->max_payload = MAX_PAYLOAD;
+    s->ring = slab_alloc(window * sizeof(slot));
+    memset(s->ring, 0, window * sizeof(slot));
+    s->stride = (max_packet + 7) & ~7;
+    s->bufs = slab_alloc(window * s->stride);
+    for (i = 0; i < window; i++) {
+        timer_init(&s->ring[i].rtx, rtx_expired);
+        s->ring[i].r = r;
+        s->ring[i].packet = (packet_t *) (s->bufs + i * s->stride);
+    }
+}
+
+int in_flight(const sender* s) {
+    return s->next_seqno - 1 - s->last_seqno_acked;
+}
+
+slot* get_slot(sender* s, int seqno) {
+    return &s->ring[seqno % s->window];
+}
+
+//stops the retransmission timers of the packets still in flight
+void free_sender(sender* s) {
+    int seqno;
+    for (seqno = s->last_seqno_acked + 1; seqno < s->next_seqno; seqno++)
+        timer_cancel(&get_slot(s, seqno)->rtx);
+    slab_free(s->ring, s->window * sizeof(slot));
+    slab_free(s->bufs, s->window * s->stride);
+}
+
+//microseconds elapsed since since, by the loop's clock: no clock read
+//per ack
+long elapsed_us(uint64_t since) {
+    return timer_now_us() - since;
+}
+
+void init_rtt(rtt_estimator* e, int timeout) {
+    e->srtt = 0;
+    e->rttvar = 0;
+    e->rto = timeout;
+    e->max_rto = timeout;
+    e->min_rto = MIN_RTO;
+}
+
+//the peer may hold an ack for up to ms, so a sample can run that much
+//long without anything being lost: raise the floor to cover it
+void rtt_peer_delay(rtt_estimator* e, int ms) {
+    int min_rto = MIN_RTO + ms;
+    if (min_rto > e->max_rto) min_rto = e->max_rto;
+    e->min_rto = min_rto;
+    if (e->rto < min_rto) e->rto = min_rto;
+}
+
+//Jacobson/Karels: fold in one RTT sample (in microseconds) and recompute
+//the timeout, clamped to [min_rto, max_rto]
+void rtt_sample(rtt_estimator* e, long rtt) {
+    long rto;
+    if (e->srtt == 0) {
+        e->srtt = rtt > 0 ? rtt : 1;
+        e->rttvar = rtt / 2;
+    } else {
+        long err = rtt - e->srtt;
+        e->rttvar += ((err < 0 ? -err : err) - e->rttvar) / 4;
+        e->srtt += err / 8;
+    }
+    rto = (e->srtt + 4 * e->rttvar + 999) / 1000;
+    if (rto < e->min_rto) rto = e->min_rto;
+    if (rto > e->max_rto) rto = e->max_rto;
+    e->rto = rto;
+}
+//the trailer starts right after the len bytes of the ack
+void ntoh_sack(const packet_t* pkt, size_t net_len, struct sack_ext* sack) {
+    size_t ext_len = net_len - ACK_HEADER_LENGTH;
+    size_t hdr_len = offsetof(struct sack_ext, blocks);
+    int i;
+    sack->magic = 0;
+    if (ext_len < hdr_len)
+        return;
+    memcpy(sack, (const char *) pkt + ACK_HEADER_LENGTH,
+           ext_len < sizeof(*sack) ? ext_len : sizeof(*sack));
+    if (ntohs(sack->magic) != SACK_MAGIC || sack->nblocks > MAX_SACK_BLOCKS ||
+        ext_len < hdr_len + sack->nblocks * sizeof(struct sack_block)) {
+        sack->magic = 0;
+        return;
+    }
+    uint16_t old_cksum = sack->cksum;
+    sack->cksum = 0;
+    if (cksum(sack, hdr_len + sack->nblocks * sizeof(struct sack_block))
+        != old_cksum) {
+        sack->magic = 0;
+        return;
+    }
+    sack->magic = SACK_MAGIC;
+    for (i = 0; i < sack->nblocks; i++) {
+        sack->blocks[i].start = ntohl(sack->blocks[i].start);
+        sack->blocks[i].end = ntohl(sack->blocks[i].end);
+    }
+}
+
+//where the trailers after an ack's SACK trailer start: right after the
+//len bytes if it has none (whether or not we use SACK ourselves)
+size_t skip_sack(const packet_t* pkt, size_t net_len) {
+    size_t off = ACK_HEADER_LENGTH;
+    struct sack_ext sack;
+    if (net_len >= off + offsetof(struct sack_ext, blocks)) {
+        memcpy(&sack, (const char *) pkt + off, offsetof(struct sack_ext, blocks));
+        if (ntohs(sack.magic) == SACK_MAGIC)
+            off += offsetof(struct sack_ext, blocks) +
+                sack.nblocks * sizeof(struct sack_block);
+    }
+    return off;
+}
+
+//the pmtu trailer follows the SACK trailer, if there is one
+bool ntoh_pmtu(const packet_t* pkt, size_t net_len, struct pmtu_ext* ext) {
+    size_t off = skip_sack(pkt, net_len);
+    uint16_t old_cksum;
+    if (net_len < off + sizeof(*ext))
+        return false;
+    memcpy(ext, (const char *) pkt + off, sizeof(*ext));
+    old_cksum = ext->cksum;
+    ext->cksum = 0;
+    if (ntohs(ext->magic) != PMTU_MAGIC || cksum(ext, sizeof(*ext)) != old_cksum)
+        return false;
+    ext->max_packet = ntohs(ext->max_packet);
+    ext->probe = ntohs(ext->probe);
+    ext->probe_ack = ntohs(ext->probe_ack);
+    return true;
 }
 
-void init_sender(sender* s) {
-    s->packet = (packet_t) { .cksum = 0,
-        .len = PACKET_HEADER_LENGTH,
-        .ackno = 1,
-        .seqno = 0
-    };
-    s->is_empty = true;
-    s->last_seqno_sent = 0;
+//the delayed-ack trailer comes last, after the SACK and pmtu trailers
+bool ntoh_ackdelay(const packet_t* pkt, size_t net_len,
+                   struct ackdelay_ext* ext) {
+    size_t off = skip_sack(pkt, net_len);
+    struct pmtu_ext pmtu;
+    uint16_t old_cksum;
+    if (net_len >= off + sizeof(pmtu)) {
+        memcpy(&pmtu, (const char *) pkt + off, sizeof(pmtu));
+        if (ntohs(pmtu.magic) == PMTU_MAGIC)
+            off += sizeof(pmtu);
+    }
+    if (net_len < off + sizeof(*ext))
+        return false;
+    memcpy(ext, (const char *) pkt + off, sizeof(*ext));
+    old_cksum = ext->cksum;
+    ext->cksum = 0;
+    if (ntohs(ext->magic) != ACKDELAY_MAGIC ||
+        cksum(ext, sizeof(*ext)) != old_cksum)
+        return false;
+    ext->delay = ntohs(ext->delay);
+    return true;
+}
+
+int effective_window(const rel_t *r) {
+    if (r->cong.ops && r->cong.cwnd < r->send.window)
+        return r->cong.cwnd;
+    return r->send.window;
+}
+
+void grow_cwnd(rel_t *r, int newly_acked) {
+    congestion *cg = &r->cong;
+    if (cg->cwnd < cg->ssthresh) {
+        cg->cwnd += newly_acked; //slow start
+    } else {
+        cg->acked_cnt += newly_acked; //congestion avoidance, +1 per window
+        if (cg->acked_cnt >= cg->cwnd) {
+            cg->acked_cnt -= cg->cwnd;
+            cg->cwnd++;
+        }
+    }
+    //no point growing past what the ring can hold
+    if (cg->cwnd > r->send.window)
+        cg->cwnd = r->send.window;
+}
+
+void halve_cwnd(rel_t *r) {
+    int half = in_flight(&r->send) / 2;
+    r->cong.ssthresh = half < 2 ? 2 : half;
+    r->cong.acked_cnt = 0;
+}
+
+void newreno_on_ack(rel_t *r, int newly_acked) {
+    congestion *cg = &r->cong;
+    if (!cg->in_recovery) {
+        grow_cwnd(r, newly_acked);
+    } else if (r->send.last_seqno_acked >= cg->recover) {
+        cg->in_recovery = false; //full ack: deflate and carry on
+        cg->cwnd = cg->ssthresh;
+    } else {
+        //partial ack: the next hole was lost too, resend it right away
+        resend(r, get_slot(&r->send, r->send.last_seqno_acked + 1));
+    }
+}
+
+void newreno_on_loss(rel_t *r) {
+    congestion *cg = &r->cong;
+    if (cg->in_recovery)
+        return;
+    halve_cwnd(r);
+    cg->cwnd = cg->ssthresh;
+    cg->in_recovery = true;
+    cg->recover = r->send.next_seqno - 1;
+}
+
+void newreno_on_timeout(rel_t *r) {
+    halve_cwnd(r);
+    r->cong.cwnd = 1;
+    r->cong.in_recovery = false;
+}
+
+void newreno_on_rtt_sample(rel_t *r, long rtt) {
+}
+
+const congestion_ops newreno_ops = {
+    newreno_on_ack, newreno_on_loss, newreno_on_timeout, newreno_on_rtt_sample
+};
+
+//Vegas: once per round trip, compare the RTT we see with the best one we
+//have ever seen; the difference says how many of our packets are sitting
+//in queues.  Keep that between VEGAS_ALPHA and VEGAS_BETA packets.
+#define VEGAS_ALPHA 2
+#define VEGAS_BETA  4
+#define VEGAS_GAMMA 1
+
+void vegas_on_ack(rel_t *r, int newly_acked) {
+    congestion *cg = &r->cong;
+    if (r->send.last_seqno_acked < cg->round_end)
+        return;
+    //a round trip is over
+    cg->round_end = r->send.next_seqno;
+    if (cg->round_rtt == 0) {
+        grow_cwnd(r, newly_acked); //no clean sample, fall back to Reno
+        return;
+    }
+    long queued = cg->cwnd * (cg->round_rtt - cg->base_rtt) / cg->round_rtt;
+    cg->round_rtt = 0;
+    if (cg->cwnd < cg->ssthresh) {
+        if (queued > VEGAS_GAMMA) {
+            cg->ssthresh = cg->cwnd; //queue is building, leave slow start
+        } else {
+            cg->cwnd *= 2;
+        }
+    } else if (queued < VEGAS_ALPHA) {
+        cg->cwnd++;
+    } else if (queued > VEGAS_BETA && cg->cwnd > 2) {
+        cg->cwnd--;
+    }
+    if (cg->cwnd > r->send.window)
+        cg->cwnd = r->send.window;
+}
+
+void vegas_on_loss(rel_t *r) {
+    congestion *cg = &r->cong;
+    cg->cwnd = cg->cwnd * 3 / 4;
+    if (cg->cwnd < 2)
+        cg->cwnd = 2;
+    cg->ssthresh = cg->cwnd;
+}
+
+void vegas_on_timeout(rel_t *r) {
+    newreno_on_timeout(r);
+}
+
+void vegas_on_rtt_sample(rel_t *r, long rtt) {
+    congestion *cg = &r->cong;
+    if (cg->base_rtt == 0 || rtt < cg->base_rtt)
+        cg->base_rtt = rtt;
+    if (cg->round_rtt == 0 || rtt < cg->round_rtt)
+        cg->round_rtt = rtt;
+}
+
+const congestion_ops vegas_ops = {
+    vegas_on_ack, vegas_on_loss, vegas_on_timeout, vegas_on_rtt_sample
+};
+
+void init_congestion(congestion* cg, int algorithm, int window) {
+    memset(cg, 0, sizeof(*cg));
+    switch (algorithm) {
+    case CC_NEWRENO:
+        cg->ops = &newreno_ops;
+        break;
+    case CC_VEGAS:
+        cg->ops = &vegas_ops;
+        break;
+    default:
+        cg->ops = NULL;
+        break;
+    }
+    cg->cwnd = 2;
+    cg->ssthresh = window;
+    cg->round_end = 1;
+}
+
+//checks the checksum without converting anything
+bool cksum_ok(packet_t* pkt, size_t net_len) {
+    uint16_t old_cksum = pkt->cksum;
+    size_t pkt_len = ntohs(pkt->len);
+    bool ok;
+    if (pkt_len > net_len)
+        return false;
+    pkt->cksum = 0;
+    ok = cksum(pkt, pkt_len) == old_cksum;
+    pkt->cksum = old_cksum;
+    return ok;
 }
+
 //could consider passing a function, but probably not worth it
 //returns: 1  if packet
 //         0  if ack
 //         -1 if cksum fails
 //         2  if eof indicator
-int ntoh_packet(packet_t* pkt, size_t net_len) {
+//if sack isn't NULL, an ack's SACK trailer is validated and converted
+//into it; sack->magic is left 0 when there isn't a valid one
+int ntoh_packet(packet_t* pkt, size_t net_len, int max_len,
+                struct sack_ext* sack) {
     // packet_t * pkt = ((packet_t*)_pkt);
     
     int old_cksum = pkt->cksum;
     int pkt_len = ntohs(pkt->len);
+    if (net_len < ACK_HEADER_LENGTH || pkt_len < ACK_HEADER_LENGTH ||
+        (pkt_len > ACK_HEADER_LENGTH && pkt_len < PACKET_HEADER_LENGTH) ||
+        pkt_len > max_len) { //no such packet, or too big for us
+        return -1;
+    }
     pkt->cksum = 0;
     if(net_len < pkt_len || (cksum(pkt, pkt_len) != old_cksum)) { // can't read packet/cksum should fail
         return -1;
@@ -93,13 +561,15 @@ int ntoh_packet(packet_t* pkt, size_t net_len) {
     pkt->len = pkt_len;
     pkt->ackno = ntohl(pkt->ackno);
     if(pkt->len == ACK_HEADER_LENGTH) {
+        if (sack)
+            ntoh_sack(pkt, net_len, sack);
         return 0;
     }
+    
+    pkt->seqno = ntohl(pkt->seqno);
     if (pkt->len == PACKET_HEADER_LENGTH) { //means teardown
         return 2;
     }
-    
-    pkt->seqno = ntohl(pkt->seqno);
     return 1;
 }
 
@@ -107,7 +577,7 @@ void hton_packet(packet_t* packet) {
     int len = packet->len;
     packet->len = htons(packet->len);
     packet->ackno = htonl(packet->ackno);
-    if(packet->len >= PACKET_HEADER_LENGTH) {
+    if(len >= PACKET_HEADER_LENGTH) {
         packet->seqno = htonl(packet->seqno);
     }
     packet->cksum = 0;
@@ -115,14 +585,112 @@ void hton_packet(packet_t* packet) {
 }
 
 
-void send_end_connection(rel_t *s) {
-    s->send.packet.seqno++;
-    s->send.packet.len = 0;
-    s->send.packet.ackno = 1;
-    send_packet(s);
+//queues a data packet with len bytes of payload already in its slot and
+//sends it; an EOF is just a packet with no payload
+void send_new_packet(rel_t *s, int len) {
+    slot *sl = get_slot(&s->send, s->send.next_seqno);
+    sl->packet->len = PACKET_HEADER_LENGTH + len;
+    if (len < s->send.max_payload)
+        s->send.small_seqno = s->send.next_seqno;
+    sl->packet->seqno = s->send.next_seqno++;
+    sl->packet->ackno = s->recv.last_seqno_processed+1;
+    hton_packet(sl->packet);
+    sl->rto = s->rtt.rto;
+    sl->retransmitted = false;
+    sl->sacked = false;
+    sl->deferred = false;
+    send_slot(s, sl);
+    sl->sent = timer_now_us();
+    timer_set(&sl->rtx, sl->rto);
 }
 
 
+void table_place(rel_t **slots, int size, rel_t *r) {
+    int i = r->hash & (size - 1);
+    while (slots[i] && slots[i] != &table_tombstone)
+        i = (i + 1) & (size - 1);
+    slots[i] = r;
+}
+
+//moves up to n slots of the old array into the current one.  A moved
+//entry leaves a tombstone, so table_remove taking out the new copy
+//doesn't leave table_lookup finding the old one.
+void table_migrate(rel_table *t, int n) {
+    while (t->old && n-- > 0) {
+        rel_t *r = t->old[t->migrate_pos];
+        if (r && r != &table_tombstone) {
+            table_place(t->slots, t->size, r);
+            t->old[t->migrate_pos] = &table_tombstone;
+            t->used++;
+        }
+        if (++t->migrate_pos == t->old_size) {
+            free(t->old);
+            t->old = NULL;
+        }
+    }
+}
+
+rel_t **table_find(rel_t **slots, int size, const struct sockaddr_storage *ss,
+                   unsigned int hash) {
+    int i = hash & (size - 1);
+    while (slots[i]) {
+        if (slots[i] != &table_tombstone && slots[i]->hash == hash &&
+            addreq(&slots[i]->peer, ss))
+            return &slots[i];
+        i = (i + 1) & (size - 1);
+    }
+    return NULL;
+}
+
+rel_t **table_lookup(rel_table *t, const struct sockaddr_storage *ss) {
+    unsigned int hash = addrhash(ss);
+    rel_t **e;
+    table_migrate(t, TABLE_MIGRATE_STEP);
+    if (!t->slots)
+        return NULL;
+    if ((e = table_find(t->slots, t->size, ss, hash)))
+        return e;
+    if (t->old)
+        return table_find(t->old, t->old_size, ss, hash);
+    return NULL;
+}
+
+void table_insert(rel_table *t, rel_t *r) {
+    table_migrate(t, TABLE_MIGRATE_STEP);
+    if (!t->slots || (t->used + 1) * 4 > t->size * 3) {
+        //keep at most 75% full, counting tombstones.  If the last move
+        //hasn't finished yet (only under an insert storm), finish it now.
+        table_migrate(t, t->old_size);
+        int live = 0, i;
+        for (i = 0; t->slots && i < t->size; i++)
+            if (t->slots[i] && t->slots[i] != &table_tombstone)
+                live++;
+        int size = TABLE_MIN_SIZE;
+        while ((live + 1) * 2 > size)
+            size *= 2;
+        t->old = t->slots;
+        t->old_size = t->size;
+        t->migrate_pos = 0;
+        t->slots = xmalloc(size * sizeof(rel_t *));
+        memset(t->slots, 0, size * sizeof(rel_t *));
+        t->size = size;
+        t->used = 0;
+        if (!t->old)
+            t->old_size = 0;
+    }
+    table_place(t->slots, t->size, r);
+    t->used++;
+    r->in_table = true;
+}
+
+void table_remove(rel_table *t, rel_t *r) {
+    rel_t **e = table_lookup(t, &r->peer);
+    if (e && *e == r)
+        *e = &table_tombstone;
+    r->in_table = false;
+    assert(!table_lookup(t, &r->peer)); //no copy left in either array
+}
+
 /* Creates a new reliable protocol session, returns NULL on failure.
  * Exactly one of c and ss should be NULL.  (ss is NULL when called
  * from rlib.c, while c is NULL when this function is called from
@@ -133,13 +701,13 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss,
 {
     rel_t *r;
     
-    r = xmalloc (sizeof (*r));
+    r = slab_alloc (sizeof (*r));
     memset (r, 0, sizeof (*r));
     
     if (!c) {
         c = conn_create (r, ss);
         if (!c) {
-            free (r);
+            slab_free (r, sizeof (*r));
             return NULL;
         }
     }
@@ -152,9 +720,23 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss,
     rel_list = r;
     
     /* Do any other initialization you need here */
-    init_receiver(&r->recv);
-    init_sender(&r->send);
-    r->kill_all =false;
+    init_receiver(&r->recv, cc->window, cc->ack_every, cc->ack_delay);
+    init_sender(r, &r->send, cc->window, cc->dupack_threshold, cc->nodelay,
+                cc->max_packet);
+    r->tick = cc->timer;
+    r->state = OPEN;
+    timer_init(&r->linger, linger_expired);
+    r->pmtu.max_packet = cc->max_packet;
+    r->pmtu.good = PACKET_HEADER_LENGTH + MAX_PAYLOAD;
+    timer_init(&r->pmtu.timer, probe_expired);
+    init_rtt(&r->rtt, cc->timeout);
+    r->sack = cc->sack;
+    init_congestion(&r->cong, cc->congestion, cc->window);
+    if (ss) {
+        r->peer = *ss;
+        r->hash = addrhash(ss);
+        table_insert(&rel_by_addr, r);
+    }
     return r;
 }
 
@@ -165,8 +747,15 @@ rel_destroy (rel_t *r)
         r->next->prev = r->prev;
     *r->prev = r->next;
     conn_destroy (r->c);
+    if (r->in_table)
+        table_remove(&rel_by_addr, r);
     
     /* Free any other allocated memory here */
+    free_receiver(&r->recv);
+    free_sender(&r->send);
+    timer_cancel(&r->linger);
+    pmtu_done(r);
+    slab_free(r, sizeof(*r));
 }
 
 
@@ -183,14 +772,30 @@ rel_demux (const struct config_common *cc,
            const struct sockaddr_storage *ss,
            packet_t *pkt, size_t len)
 {
+    rel_t **e = table_lookup(&rel_by_addr, ss);
+    rel_t *r;
+    if (e) {
+        r = *e;
+    } else {
+        //only an intact first data packet opens a connection
+        if (len < PACKET_HEADER_LENGTH || ntohs(pkt->len) < PACKET_HEADER_LENGTH
+            || ntohl(pkt->seqno) != 1 || !cksum_ok(pkt, len)) {
+            conn_trace(NULL, TR_DROP, 0, 0, len);
+            return;
+        }
+        r = rel_create(NULL, ss, cc);
+        if (!r)
+            return;
+    }
+    rel_recvpkt(r, pkt, len);
 }
 
 
 
 
-void send_packet(rel_t *s) {
-    s->send.packet.ackno = s->recv.last_seqno_processed+1;
-    packet_t packet = s->send.packet;
+void send_packet(rel_t *s, packet_t *pkt) {
+    pkt->ackno = s->recv.last_seqno_processed+1;
+    packet_t packet = *pkt;
     
     int len = packet.len;
     hton_packet(&packet);
@@ -200,92 +805,512 @@ void send_packet(rel_t *s) {
 }
 
 
+//sends a data packet from its slot.  Only the ackno can have changed
+//since it was checksummed, so patch that in with cksum_update instead of
+//summing the payload again.
+void send_slot(rel_t *s, slot *sl) {
+    uint32_t ackno = htonl(s->recv.last_seqno_processed+1);
+    int len = ntohs(sl->packet->len);
+    s->recv.unacked = 0; //the data carries the ack
+    timer_cancel(&s->recv.ack_timer);
+    if (sl->packet->ackno != ackno) {
+        sl->packet->cksum = cksum_update(sl->packet->cksum, &sl->packet->ackno,
+                                         &ackno, sizeof(ackno));
+        sl->packet->ackno = ackno;
+    }
+    if (conn_sendpkt (s->c, sl->packet, len) != len) {
+        exit(1);
+    }
+}
+
+//fills in the ranges of out-of-order packets we hold, lowest first;
+//returns the trailer length
+int build_sack(rel_t *r, struct sack_ext *sack) {
+    receiver *rv = &r->recv;
+    int seqno = rv->last_seqno_processed + 2; //+1 is the hole being acked
+    int last = rv->last_seqno_processed + rv->window;
+    int i, n = 0;
+    while (seqno <= last && n < MAX_SACK_BLOCKS) {
+        if (!is_present(rv, seqno)) {
+            seqno++;
+            continue;
+        }
+        sack->blocks[n].start = htonl(seqno);
+        while (seqno <= last && is_present(rv, seqno))
+            seqno++;
+        sack->blocks[n++].end = htonl(seqno);
+    }
+    sack->magic = htons(SACK_MAGIC);
+    sack->nblocks = n;
+    for (i = 0; i < sizeof(sack->pad); i++)
+        sack->pad[i] = 0;
+    sack->cksum = 0;
+    int len = offsetof(struct sack_ext, blocks) + n * sizeof(struct sack_block);
+    sack->cksum = cksum(sack, len);
+    return len;
+}
+
+//-m was given, so acks say how big a packet we take
+bool pmtu_on(const rel_t *r) {
+    return r->pmtu.max_packet > sizeof(packet_t);
+}
+
+//fills in our pmtu trailer; returns its length
+int build_pmtu(rel_t *r, struct pmtu_ext *ext, int probe) {
+    ext->magic = htons(PMTU_MAGIC);
+    ext->max_packet = htons(r->pmtu.max_packet);
+    ext->probe = htons(probe);
+    ext->probe_ack = htons(r->pmtu.answer);
+    ext->pad = 0;
+    ext->cksum = 0;
+    ext->cksum = cksum(ext, sizeof(*ext));
+    return sizeof(*ext);
+}
+
+//fills in the trailer telling the peer how long we may hold an ack;
+//returns its length
+int build_ackdelay(rel_t *r, struct ackdelay_ext *ext) {
+    int delay = r->recv.ack_delay;
+    ext->magic = htons(ACKDELAY_MAGIC);
+    ext->delay = htons(delay < 0xffff ? delay : 0xffff);
+    ext->pad = 0;
+    ext->cksum = 0;
+    ext->cksum = cksum(ext, sizeof(*ext));
+    return sizeof(*ext);
+}
 
 void send_ackno(rel_t *r){
-    if (r->send.is_empty)
-        r->send.packet.len = ACK_HEADER_LENGTH;
+    packet_t ack = { .len = ACK_HEADER_LENGTH };
+    r->recv.unacked = 0;
+    timer_cancel(&r->recv.ack_timer);
     
-    // myPrintPacket("send packet (in ackno)", 1, &r->send.packet);
-    send_packet(r);
+    if (!r->sack && !pmtu_on(r) && r->recv.ack_every == 1) {
+        send_packet(r, &ack);
+        return;
+    }
+    //trailers go after the 8 bytes len covers, so they're padding to
+    //peers that don't know them
+    ack.ackno = r->recv.last_seqno_processed+1;
+    hton_packet(&ack);
+    int len = ACK_HEADER_LENGTH;
+    if (r->sack)
+        len += build_sack(r, (struct sack_ext *) ((char *) &ack + len));
+    if (pmtu_on(r))
+        len += build_pmtu(r, (struct pmtu_ext *) ((char *) &ack + len), 0);
+    if (r->recv.ack_every > 1)
+        len += build_ackdelay(r, (struct ackdelay_ext *) ((char *) &ack + len));
+    if (conn_sendpkt (r->c, &ack, len) != len) {
+        exit(1);
+    }
+}
+
+int pmtu_limit(const pmtu *p) {
+    return p->max_packet < p->peer_max ? p->max_packet : p->peer_max;
 }
 
+//sends the probe again (or the first time): an ack padded out to the
+//size being tried.  One too big for the path is just lost.  It goes by
+//itself, so GSO can't cut the data behind it to the probe's size.
+void send_probe(rel_t *r) {
+    pmtu *p = &r->pmtu;
+    packet_t *probe = (packet_t *) p->buf;
+    probe->len = ACK_HEADER_LENGTH;
+    probe->ackno = r->recv.last_seqno_processed+1;
+    hton_packet(probe);
+    build_pmtu(r, (struct pmtu_ext *) (p->buf + ACK_HEADER_LENGTH), p->probe);
+    conn_sendprobe(r->c, probe, p->probe);
+    p->tries++;
+    timer_set(&p->timer, r->rtt.rto);
+}
+
+void pmtu_done(rel_t *r) {
+    pmtu *p = &r->pmtu;
+    timer_cancel(&p->timer);
+    if (p->buf)
+        free(p->buf);
+    p->buf = NULL;
+    p->probe = 0;
+}
 
-void do_tear_down(rel_t *r) {
-    //    if (r->recv.len == 0) {
-    //        conn_output(r->c, r->recv.data, 0);
-    //    }
-    //    send eof
-    //    send acks until done
-    //    You have read an EOF from the other side (i.e., a Data packet of len 12, where the payload field is 0 bytes).
-    //    You have read an EOF or error from your input (conn_input returned -1).
-    //    All packets you have sent have been acknowledged.
-    //    You have written all output data with conn_output.
+//probes the next size: the limit first, which on loopback or a jumbo
+//frame LAN is all it takes, then halfway between good and bad.  Once
+//our EOF is out there is nothing left to send in bigger packets.
+void pmtu_next(rel_t *r) {
+    pmtu *p = &r->pmtu;
+    if (p->bad - p->good <= PMTU_STEP || r->send.eof_sent) {
+        pmtu_done(r);
+        return;
+    }
+    p->probe = p->bad > pmtu_limit(p) ? pmtu_limit(p) : (p->good + p->bad) / 2;
+    p->tries = 0;
+    send_probe(r);
+}
+
+//handles the pmtu trailer of an ack n bytes long; returns true if the
+//ack is a probe or answers one, and so says nothing about loss
+bool pmtu_recv(rel_t *r, const struct pmtu_ext *ext, size_t n) {
+    pmtu *p = &r->pmtu;
+    if (!p->peer_max && ext->max_packet >= sizeof(packet_t))
+        p->peer_max = ext->max_packet; //the peer takes large packets
+    //find out what the path takes, once there is an RTT sample to say
+    //how long to wait for each answer
+    if (p->peer_max && !p->bad && r->rtt.srtt) {
+        p->bad = pmtu_limit(p) + 1;
+        if (pmtu_limit(p) > p->good) {
+            p->buf = xmalloc(pmtu_limit(p));
+            memset(p->buf, 0, pmtu_limit(p));
+            pmtu_next(r);
+        }
+    }
+    if (ext->probe && ext->probe <= n) { //it all got here
+        p->answer = ext->probe;
+        send_ackno(r);
+        p->answer = 0;
+    }
+    if (ext->probe_ack && ext->probe_ack == p->probe) {
+        p->good = p->probe;
+        r->send.max_payload = p->good - PACKET_HEADER_LENGTH;
+        timer_cancel(&p->timer);
+        pmtu_next(r);
+    }
+    return ext->probe || ext->probe_ack;
+}
+
+
+//a TCP TIME_WAIT: long enough for the peer to time out on its EOF and
+//resend it at least once
+int linger_ms(const rel_t *r) {
+    return 2 * r->rtt.max_rto;
+}
+
+//moves r along the close handshake and destroys it once both EOFs are
+//through, all we sent is acked and the peer's EOF has gone to
+//conn_output (behind all its data; conn_destroy lets that drain).
+//Returns true if r is gone.
+bool do_tear_down(rel_t *r) {
+    if (r->state == LINGER)
+        return false;
+    if (r->send.eof_sent && r->recv.eof_delivered)
+        r->state = CLOSING;
+    else if (r->send.eof_sent)
+        r->state = EOF_SENT;
+    else if (r->recv.eof_delivered)
+        r->state = EOF_RECEIVED;
+    if (r->state != CLOSING || in_flight(&r->send) > 0)
+        return false;
+    //data packets carry acknos, so if one sent after the peer's EOF got
+    //acked, the peer knows we have its EOF (TCP's LAST_ACK).  Otherwise
+    //our last word was an ack that may have been lost, and the peer
+    //would resend its EOF to nobody; stay to answer it.
+    if (r->send.last_seqno_acked >= r->eof_acked_from) {
+        rel_destroy(r);
+        return true;
+    }
+    r->state = LINGER;
+    timer_set(&r->linger, linger_ms(r));
+    return false;
+}
+
+void resend(rel_t *r, slot *sl) {
+    r->stats.retransmits++;
+    send_slot(r, sl);
+    conn_trace(r->c, TR_RETRANSMIT, ntohl(sl->packet->seqno),
+               ntohl(sl->packet->ackno), ntohs(sl->packet->len));
+    sl->sent = timer_now_us();
+    timer_set(&sl->rtx, sl->rto);
+    sl->retransmitted = true;
+}
+
+//without SACK all we know is the first unacked packet is missing; with
+//it, every unsacked packet below the highest sacked one is a hole
+void fast_retransmit(rel_t *r) {
+    sender *s = &r->send;
+    int seqno, highest = s->last_seqno_acked + 1;
+    if (r->sack) {
+        for (seqno = s->next_seqno - 1; seqno > highest; seqno--) {
+            if (get_slot(s, seqno)->sacked) {
+                highest = seqno;
+                break;
+            }
+        }
+    }
+    for (seqno = s->last_seqno_acked + 1; seqno <= highest; seqno++) {
+        slot *sl = get_slot(s, seqno);
+        if (!sl->sacked)
+            resend(r, sl);
+    }
+}
+
+//marks the packets the peer's SACK blocks cover
+void apply_sack(rel_t *r, const struct sack_ext *sack) {
+    sender *s = &r->send;
+    int i, seqno;
+    for (i = 0; i < sack->nblocks; i++) {
+        int start = sack->blocks[i].start, end = sack->blocks[i].end;
+        if (start <= s->last_seqno_acked)
+            start = s->last_seqno_acked + 1;
+        if (end > s->next_seqno)
+            end = s->next_seqno;
+        for (seqno = start; seqno < end; seqno++)
+            get_slot(s, seqno)->sacked = true;
+    }
+}
+
+//hands the contiguous run of buffered packets after last_seqno_processed
+//to conn_output, as far as conn_bufspace allows; returns # delivered.
+//Payloads are gathered up to DELIVER_IOV at a time so a run costs one
+//conn_outputv instead of a write per packet.
+int deliver_run(rel_t *r) {
+    receiver *rv = &r->recv;
+    int delivered = 0;
+    for (;;) {
+        struct iovec iov[DELIVER_IOV];
+        size_t space = conn_bufspace(r->c), len = 0;
+        int seqno = rv->last_seqno_processed+1;
+        int i, n = 0;
+        bool full = false;
+        //n stays below window: past it the ring wraps onto seqno again
+        while (!rv->eof_delivered && n < DELIVER_IOV && n < rv->window &&
+               is_present(rv, seqno+n)) {
+            buffered *b = &rv->ring[(seqno+n) % rv->window];
+            if (b->len == 0)
+                break; //EOF goes after the data
+            if (len + b->len > space) {
+                full = true; //flow control
+                break;
+            }
+            iov[n].iov_base = b->pkt->data;
+            iov[n].iov_len = b->len;
+            len += b->len;
+            n++;
+        }
+        if (n > 0)
+            conn_outputv(r->c, iov, n);
+        for (i = 0; i < n; i++) {
+            conn_trace(r->c, TR_DELIVER, seqno+i, 0, iov[i].iov_len);
+            pkt_release(rv->ring[(seqno+i) % rv->window].pkt);
+            set_present(rv, seqno+i, false);
+        }
+        rv->last_seqno_processed += n; //change to reflect new packets
+        delivered += n;
+        seqno += n;
+        if (!rv->eof_delivered && is_present(rv, seqno) &&
+            rv->ring[seqno % rv->window].len == 0) {
+            conn_output(r->c, NULL, 0);
+            conn_trace(r->c, TR_DELIVER, seqno, 0, 0);
+            rv->eof_delivered = true;
+            r->eof_acked_from = r->send.next_seqno;
+            pkt_release(rv->ring[seqno % rv->window].pkt);
+            set_present(rv, seqno, false);
+            rv->last_seqno_processed++;
+            delivered++;
+        }
+        //out of space, look again: if conn_outputv wrote it all out,
+        //nothing is queued to get rel_output called when output drains
+        if (n == 0 || (!full && n < DELIVER_IOV && n < rv->window))
+            break; //rel_output will get called when output drains
+    }
+    return delivered;
 }
 
 void
 rel_recvpkt (rel_t *r, packet_t *pkt, size_t n) {
-    int packet_type = ntoh_packet(pkt, n);//destructive modification on pkt
-    if (packet_type == -1) return; //it's corrupted
-    if (packet_type >= 0 && //has ackno
-        r->send.last_seqno_sent == pkt->ackno-1) { //has valid ackno
-        r->send.is_empty = true;
-        
+    struct sack_ext sack;
+    r->stats.pkts_recv++;
+    r->stats.bytes_recv += n;
+    int packet_type = ntoh_packet(pkt, n, r->pmtu.max_packet,
+                                  r->sack ? &sack : NULL);//destructive modification on pkt
+    if (packet_type == -1) { //it's corrupted
+        r->stats.cksum_errors++;
+        conn_trace(r->c, TR_DROP, 0, 0, n);
+        return;
+    }
+    conn_trace(r->c, TR_RECV, packet_type >= 1 ? pkt->seqno : 0, pkt->ackno,
+               pkt->len);
+    int acked = pkt->ackno - 1;
+    bool advanced = false;
+    bool probe = false;
+    struct pmtu_ext pext;
+    if (packet_type == 0 && pmtu_on(r) && ntoh_pmtu(pkt, n, &pext))
+        probe = pmtu_recv(r, &pext, n);
+    struct ackdelay_ext aext;
+    if (packet_type == 0 && ntoh_ackdelay(pkt, n, &aext))
+        rtt_peer_delay(&r->rtt, aext.delay); //before the sample below
+    if (acked > r->send.last_seqno_acked && //acks something new
+        acked < r->send.next_seqno) { //and only what we've actually sent
+        //cumulative, so this frees every slot up to acked at once
+        slot *sl = get_slot(&r->send, acked);
+        int newly_acked = acked - r->send.last_seqno_acked;
+        int seqno;
+        if (!sl->retransmitted) {
+            long rtt = elapsed_us(sl->sent);
+            rtt_sample(&r->rtt, rtt);
+            if (r->cong.ops)
+                r->cong.ops->on_rtt_sample(r, rtt);
+        }
+        for (seqno = r->send.last_seqno_acked + 1; seqno <= acked; seqno++)
+            timer_cancel(&get_slot(&r->send, seqno)->rtx); //they made it
+        r->send.last_seqno_acked = acked;
+        r->send.dupacks = 0;
+        if (r->cong.ops)
+            r->cong.ops->on_ack(r, newly_acked);
+        advanced = true;
+    }
+    if (packet_type == 0 && r->sack && sack.magic == SACK_MAGIC)
+        apply_sack(r, &sack);
+    if (advanced) {
         rel_read(r);
-    } if (packet_type == 1 && // has data
-          r->recv.len == 0 && // can be processed
-          pkt->seqno == r->recv.last_seqno_processed+1) { //is in sequence
-        memcpy(r->recv.data, pkt->data, pkt->len);
-        r->recv.len = pkt->len - PACKET_HEADER_LENGTH;
-        rel_output(r);
+    } else if (packet_type == 0 && !probe && //data repeats its ackno
+               acked == r->send.last_seqno_acked && in_flight(&r->send) > 0) {
+        //the peer keeps asking for the same packet, so it's getting the
+        //ones after it: resend the hole now rather than at its timeout
+        if (++r->send.dupacks == r->send.dupack_threshold) {
+            if (r->cong.ops)
+                r->cong.ops->on_loss(r);
+            fast_retransmit(r);
+        }
+    } if (packet_type >= 1) { // has data, or is an EOF
+        receiver *rv = &r->recv;
+        int seqno = pkt->seqno;
+        int expected = rv->last_seqno_processed + 1;
+        int delivered;
+        if (seqno > rv->last_seqno_processed &&
+            seqno <= rv->last_seqno_processed + rv->window && //fits in window
+            !is_present(rv, seqno)) { //and isn't a duplicate
+            buffered *b = &rv->ring[seqno % rv->window];
+            b->len = pkt->len - PACKET_HEADER_LENGTH;
+            b->pkt = pkt_hold(pkt); //no copy, deliver_run writes it from here
+            set_present(rv, seqno, true);
+            if (seqno != expected)
+                r->stats.out_of_order++;
+        } else {
+            if (seqno <= rv->last_seqno_processed || is_present(rv, seqno))
+                r->stats.duplicates++;
+            conn_trace(r->c, TR_DROP, seqno, pkt->ackno, pkt->len);
+        }
+        delivered = deliver_run(r);
+        //ack right away unless this was just the next packet in order: a
+        //duplicate means our last ack got lost, an out-of-order packet
+        //tells the sender where the hole is, one that fills a hole
+        //releases a whole run, and no delivery means we're out of room
+        if (seqno != expected || delivered != 1 || rv->eof_delivered ||
+            rv->unacked + 1 >= rv->ack_every) {
+            send_ackno(r);
+        } else if (rv->unacked++ == 0) {
+            timer_set(&rv->ack_timer, rv->ack_delay);
+        }
     }
+    if (r->state == LINGER)
+        timer_set(&r->linger, linger_ms(r)); //the peer is still resending
+    else
+        do_tear_down(r);
 }
 
 
+//Nagle: a short packet may go out only once the last short one is acked
+bool may_send_short(const sender *s) {
+    return s->nodelay || s->last_seqno_acked >= s->small_seqno;
+}
+
 int rel_read (rel_t *s) {
-    if (!s->send.is_empty) return 0;
-    s->send.packet.cksum = 0;
-    s->send.packet.len = PACKET_HEADER_LENGTH;
-    int data_len = conn_input(s->c, s->send.packet.data, DATA_LEN-1);
-    if (data_len > 0) {
-        //data has been read, incr seqno and close buffer for use
-        s->send.packet.seqno++;
-        s->send.is_empty = false;
-        s->send.packet.len += data_len;
-        send_packet(s);
-        s->send.last_seqno_sent++;
-        return 1;
-    } else if (data_len == -1) {
-        //deal with EOF or error
-        //tear down the connection!
-        send_end_connection(s);
-        return -1;
+    int sent = 0;
+    //keep pulling input until the window is full
+    while (!s->send.eof_sent && in_flight(&s->send) < effective_window(s)) {
+        slot *sl = get_slot(&s->send, s->send.next_seqno);
+        int data_len = 0;
+        //top up whatever Nagle held back last time
+        if (s->send.held < s->send.max_payload)
+            data_len = conn_input(s->c, sl->packet->data + s->send.held,
+                                  s->send.max_payload - s->send.held);
+        if (data_len > 0)
+            s->send.held += data_len;
+        if (s->send.held > 0 && (s->send.held >= s->send.max_payload ||
+                                 data_len == -1 || may_send_short(&s->send))) {
+            send_new_packet(s, s->send.held); //at EOF, flush it first
+            s->send.held = 0;
+            sent++;
+        } else if (data_len > 0) {
+            continue; //held; see if more input fills the packet
+        } else if (data_len == -1) {
+            //deal with EOF or error
+            //tear down the connection!
+            s->send.eof_sent = true;
+            send_new_packet(s, 0);
+            return -1;
+        } else {
+            break;
+        }
     }
-    return 0;
+    return sent > 0;
 }
 
 void
 rel_output (rel_t *r)
 {
-    if (r->recv.len && conn_bufspace(r->c) >= r->recv.len) {
-        conn_output(r->c, r->recv.data, r->recv.len);
-        r->recv.last_seqno_processed++; //change to reflect new packet
-        r->recv.len = 0;
+    if (deliver_run(r) > 0) {
         send_ackno(r);
+        do_tear_down(r);
     }
 }
 
 void
-rel_timer ()
+rel_stats (rel_t *r, struct rel_stats *s)
 {
-    //work
-    rel_t *rel = rel_list;
-    //rel_list isn't a circle!
-    while (rel != NULL) {
-        if (!rel->send.is_empty) {
-            send_packet(rel);
-        }
-        rel = rel->next;
+    *s = r->stats;
+    s->window = effective_window(r);
+    s->srtt = r->rtt.srtt;
+    s->max_packet = PACKET_HEADER_LENGTH + r->send.max_payload;
+}
+
+//the oldest ack we're holding back has waited long enough
+void ack_expired(struct timer *t) {
+    rel_t *r = (rel_t *) ((char *) t - offsetof(rel_t, recv.ack_timer));
+    send_ackno(r);
+}
+
+//no answer to the probe; after PMTU_TRIES, take it the size is too big
+void probe_expired(struct timer *t) {
+    rel_t *r = (rel_t *) ((char *) t - offsetof(rel_t, pmtu.timer));
+    pmtu *p = &r->pmtu;
+    if (p->tries < PMTU_TRIES && !r->send.eof_sent) {
+        send_probe(r);
+        return;
     }
-    /* Retransmit any packets that need to be retransmitted */
-    
+    p->bad = p->probe;
+    pmtu_next(r);
+}
+
+//nothing more from the peer, so it got our last ack
+void linger_expired(struct timer *t) {
+    rel_destroy((rel_t *) ((char *) t - offsetof(rel_t, linger)));
+}
+
+//a packet's retransmission timeout is up.  Timers that expire together
+//make one round: congestion control hears about it once, and at most a
+//window's worth are resent; the rest wait another tick.  One that was
+//waiting is still part of its old round, so it doesn't start a new one.
+void rtx_expired(struct timer *t) {
+    slot *sl = (slot *) ((char *) t - offsetof(slot, rtx));
+    rel_t *r = sl->r;
+    if (sl->sacked)
+        return; //the peer has it; the cumulative ack will come
+    if (!sl->deferred && r->timeout_round != timer_now()) {
+        r->timeout_round = timer_now();
+        if (r->cong.ops)
+            r->cong.ops->on_timeout(r);
+    }
+    if (r->resend_tick != timer_now()) {
+        r->resend_tick = timer_now();
+        r->timeout_resent = 0;
+    }
+    if (r->timeout_resent >= effective_window(r)) {
+        sl->deferred = true;
+        timer_set(t, r->tick);
+        return;
+    }
+    sl->deferred = false;
+    r->timeout_resent++;
+    //exponential backoff, capped at -t
+    sl->rto = sl->rto * 2 > r->rtt.max_rto ? r->rtt.max_rto : sl->rto * 2;
+    resend(r, sl);
 }
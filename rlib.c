@@ -1,5 +1,7 @@
 /* rlib version 5 */
 
+#define _GNU_SOURCE 1		/* for recvmmsg and sendmmsg */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -13,11 +15,42 @@
 #include <stddef.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <poll.h>
 #include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Build with -DUSE_EPOLL=0 to leave out the epoll(7) backend. */
+#ifndef USE_EPOLL
+# ifdef __linux__
+#  define USE_EPOLL 1
+# else
+#  define USE_EPOLL 0
+# endif
+#endif
+#if USE_EPOLL
+#include <sys/epoll.h>
+#endif /* USE_EPOLL */
+
+/* Build with -DUSE_GSO=0 to leave out UDP segmentation offload. */
+#ifndef USE_GSO
+# ifdef UDP_SEGMENT
+#  define USE_GSO 1
+# else
+#  define USE_GSO 0
+# endif
+#endif
 
 #include "rlib.h"
+#include "trace.h"
 
 char *progname;
 int opt_debug;
@@ -38,25 +71,46 @@ struct config_server {
                                      address */
 };
 
-static struct config_server *serverconf;
+/* The event loop's state is per thread: with -T, each server shard
+ * runs its own loop over its own connections (see do_shards). */
+static __thread struct config_server *serverconf;
 
 static void conn_mkevents (void);
-static int debug_recv (int s, packet_t *buf, size_t len, int flags,
-                       struct sockaddr_storage *from);
-
-int cevents_generation;
-static struct pollfd *cevents;
-static int ncevents;
-static conn_t **evreaders;
-static conn_t **evwriters;
-
-struct chunk {
-    struct chunk *next;
-    size_t size;
-    size_t used;
-    char buf[1];
+static int rx_recvmmsg (int s, int want_from);
+
+/* poll(2) backend: cevents is rebuilt whenever the set of connections
+ * changes. */
+__thread int cevents_generation;
+static __thread int last_cg;
+static __thread struct pollfd *cevents;
+static __thread int ncevents;
+static __thread size_t cevents_size;	/* allocated; only ever grows */
+static __thread conn_t **evreaders;
+static __thread conn_t **evwriters;
+
+/* Accept (client) or UDP (server) socket watched besides the
+ * connections, and whether it was ready after the last conn_poll. */
+static __thread int listen_fd = -1;
+static __thread int listen_ready;
+
+/* One descriptor registered with epoll.  data.ptr of its epoll_event
+ * points here, so a ready event leads straight to its connection. */
+struct evsrc {
+    struct conn *c;		/* NULL for listen_ev and stderr_ev */
+    int fd;			/* -1 once removed */
+    uint32_t events;		/* current interest */
 };
-typedef struct chunk chunk_t;
+
+/* epoll(7) backend: descriptors are registered once, when their
+ * connection is set up, and only interest bits change after that. */
+static __thread int use_epoll = USE_EPOLL;
+static int opt_poll;		/* -P */
+#if USE_EPOLL
+#define EP_MAXEVENTS 64
+static __thread int epfd = -1;
+static __thread struct evsrc listen_ev = { NULL, -1, 0 };
+static __thread struct evsrc stderr_ev = { NULL, -1, 0 };
+#endif /* USE_EPOLL */
 
 struct conn {
     rel_t *rel;			/* Data from reliable */
@@ -64,6 +118,9 @@ struct conn {
     int rpoll;			/* offsets into cevents array */
     int wpoll;
     int npoll;
+    struct evsrc rev;		/* epoll registrations; wfd shares rev */
+    struct evsrc wev;		/* when it is the same as rfd */
+    struct evsrc nev;
     
     int rfd;			/* input file descriptor */
     int wfd;			/* output file descriptor */
@@ -75,22 +132,122 @@ struct conn {
     char write_eof;		/* send EOF when output queue drained */
     char write_err;	        /* zero if it's okay to write to wfd */
     char xoff;			/* non-zero to pause reading */
+    char did_read;		/* conn_input called since the fd woke us */
     char delete_me;		/* delete after draining */
-    chunk_t *outq;		/* chunks not yet written */
-    chunk_t **outqtail;
+    char *outq;			/* ring of bytes not yet written */
+    size_t outsize;		/* capacity of outq */
+    size_t outhead;		/* offset of the oldest byte in outq */
+    size_t outused;		/* bytes queued in outq */
+    char wtcp;			/* wfd is a TCP socket */
+    char corked;		/* in cork_conns, holding back a segment */
+    
+    uint64_t id;		/* names it in the stats dump */
+    uint64_t pkts_sent;		/* datagrams handed to conn_sendpkt */
+    uint64_t bytes_sent;
+    uint64_t bytes_in;		/* taken from rfd by conn_input */
+    uint64_t bytes_out;		/* accepted by conn_output(v) */
     
     struct conn *next;		/* Linked list of connections */
     struct conn **prev;
 };
 
-static conn_t *conn_list;
-struct timespec last_timeout;
+static __thread conn_t *conn_list;
+
+/* This loop's counters for the stats dump; connections keep their own.
+ * With -T, shard_id names the shard. */
+struct loop_stats {
+    uint64_t pkts_recv;		/* datagrams off the network */
+    uint64_t bytes_recv;
+    uint64_t pkts_sent;
+    uint64_t bytes_sent;
+    uint64_t conns_opened;
+    uint64_t mallocs;		/* xmalloc calls */
+    uint64_t slab_allocs;
+    uint64_t slab_frees;
+    uint64_t slab_chunks;	/* SLAB_CHUNKs mapped... */
+    uint64_t slab_huge;		/* ...and how many of those in huge pages */
+};
+static __thread struct loop_stats lstats;
+static __thread int shard_id = -1;
+
+/* -M: serve a dump to whoever connects to this Unix socket */
+static char *opt_stats;
+static __thread int stats_fd = -1;
+#if USE_EPOLL
+static __thread struct evsrc stats_ev = { NULL, -1, 0 };
+#endif /* USE_EPOLL */
+/* SIGUSR1 bumps stats_requests; each loop dumps to stderr on seeing it */
+static volatile sig_atomic_t stats_requests;
+static __thread sig_atomic_t stats_seen;
+/* With -T, the main thread takes SIGUSR1 and passes it on to each shard
+ * as SIGWAKE.  A shard keeps SIGWAKE blocked except while it waits for
+ * events, so one that comes while the loop is busy ends the next wait
+ * instead of being missed. */
+#define SIGWAKE SIGRTMIN
+static __thread sigset_t wait_set;
+static __thread sigset_t *wait_mask;	/* &wait_set in a shard */
+
+/* Receive buffers for up to rx_batch datagrams per recvmmsg call.  They
+ * come from the packet pool, so a protocol that keeps one (pkt_hold)
+ * just leaves it behind and the slot gets a fresh buffer. */
+static __thread int rx_batch;
+static __thread packet_t **rx_pkts;
+static __thread struct sockaddr_storage *rx_addrs;
+static __thread struct iovec *rx_iovs;
+static __thread struct mmsghdr *rx_msgs;
+
+/* While a batch is being handed to the protocol, rx_pending says more
+ * datagrams from it are still to come.  Output to TCP then goes out
+ * with MSG_MORE, and conn_uncork pushes it once the batch is done. */
+static __thread int rx_pending;
+static __thread conn_t **cork_conns;	/* rx_batch entries */
+static __thread int ncork;
+
+/* Every packet buffer has room for pkt_size bytes: sizeof (packet_t),
+ * or more with -m (config_common.max_packet).  The packet_t is then
+ * only the start of the buffer. */
+static size_t pkt_size = sizeof (packet_t);
+static int opt_pmtud;		/* set DF on UDP sockets, for probing */
+static int udp_bufsize;		/* with -m: a window of the largest packets */
+
+/* Optional send queue: conn_sendpkt appends here, and conn_poll sends
+ * the lot with one sendmmsg per run of packets for the same socket. */
+static __thread int tx_batch;		/* 0 when sends go out immediately */
+static __thread int tx_count;
+static __thread char *tx_bufs;		/* tx_batch buffers of pkt_size */
+static __thread struct sockaddr_storage *tx_addrs;
+static __thread int *tx_fds;
+static __thread struct iovec *tx_iovs;
+static __thread struct mmsghdr *tx_msgs;
+
+/* UDP GSO (UDP_SEGMENT, Linux 4.18): a run of same-sized datagrams for
+ * one peer goes out as a single message, and the kernel (or the NIC)
+ * cuts it back into datagrams.  udp_gso is cleared by -G, or for good
+ * the first time the kernel says it can't segment at all. */
+#define GSO_MAX_SEGS 64		/* UDP_MAX_SEGMENTS before Linux 6.9 */
+#define GSO_MAX_BYTES 65507	/* all of them together, as one datagram */
+struct gso_batch {
+    struct mmsghdr *msgs;	/* one per run */
+    int *nsegs;			/* datagrams in each */
+    char (*cmsgs)[CMSG_SPACE (sizeof (uint16_t))];
+};
+static int udp_gso = USE_GSO;
+static __thread struct gso_batch tx_gso;
+
+/* With -I, a second thread owns the UDP socket (see io_start) */
+struct iothr;
+static __thread struct iothr *iot;
+static int opt_iothread;
+static int io_owns (int fd);
+static int io_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
+static void io_flush (void);
 
 #if !DMALLOC
 void *
 xmalloc (size_t n)
 {
     void *p = malloc (n);
+    lstats.mallocs++;
     if (!p) {
         fprintf (stderr, "%s: out of memory allocating %d bytes\n",
                  progname, (int) n);
@@ -100,6 +257,131 @@ xmalloc (size_t n)
 }
 #endif /* !DMALLOC */
 
+/* Slab allocator for what comes and goes with connections: rel_t and
+ * conn_t, their rings and packet buffers.  Each loop keeps a cache per
+ * object size (rounded up to SLAB_ALIGN).  A cache carves objects out
+ * of SLAB_CHUNK-byte chunks from mmap, in huge pages with -H where the
+ * system has them, and keeps freed objects on a free list.  So once a
+ * loop has seen its peak number of connections, opening and closing
+ * more allocates nothing.  Memory never goes back to the system.
+ * Objects over SLAB_MAX, and sizes beyond the first SLAB_CACHES, come
+ * from xmalloc instead.
+ *
+ * Every size seen takes a cache for good, so this is only for sizes
+ * fixed for the run (by the options).  Anything else, like a hash
+ * table that grows, belongs with xmalloc. */
+#define SLAB_ALIGN 64		/* a cache line */
+#define SLAB_CHUNK (2 << 20)	/* a huge page on x86-64 */
+#define SLAB_MAX (SLAB_CHUNK / 8)
+#define SLAB_CACHES 16
+
+struct slab_obj {
+    struct slab_obj *next;
+};
+
+struct slab_cache {
+    size_t size;		/* 0 while unused */
+    struct slab_obj *free;
+    char *next;			/* rest of the newest chunk */
+    char *end;
+};
+static __thread struct slab_cache slab_caches[SLAB_CACHES];
+static int opt_hugepages;	/* -H */
+
+/* The cache for size n, started if need be; NULL if they're all taken */
+static struct slab_cache *
+slab_cache (size_t n, int start)
+{
+    int i;
+    
+    n = (n + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1);
+    for (i = 0; i < SLAB_CACHES && slab_caches[i].size; i++)
+        if (slab_caches[i].size == n)
+            return &slab_caches[i];
+    if (i == SLAB_CACHES || !start)
+        return NULL;
+    slab_caches[i].size = n;
+    return &slab_caches[i];
+}
+
+static void
+slab_grow (struct slab_cache *sc)
+{
+    void *p = MAP_FAILED;
+    
+#ifdef MAP_HUGETLB
+    if (opt_hugepages) {
+        p = mmap (NULL, SLAB_CHUNK, PROT_READ|PROT_WRITE,
+                  MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            lstats.slab_huge++;
+    }
+#endif /* MAP_HUGETLB */
+    if (p == MAP_FAILED) {
+        p = mmap (NULL, SLAB_CHUNK, PROT_READ|PROT_WRITE,
+                  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf (stderr, "%s: out of memory mapping a %d byte slab\n",
+                     progname, SLAB_CHUNK);
+            abort ();
+        }
+#ifdef MADV_HUGEPAGE
+        /* No reserved huge pages; transparent ones will do */
+        if (opt_hugepages)
+            madvise (p, SLAB_CHUNK, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+    }
+    lstats.slab_chunks++;
+    sc->next = p;
+    sc->end = sc->next + SLAB_CHUNK;
+}
+
+void *
+slab_alloc (size_t n)
+{
+#if DMALLOC
+    return xmalloc (n);
+#else /* !DMALLOC */
+    struct slab_cache *sc = n <= SLAB_MAX ? slab_cache (n, 1) : NULL;
+    void *p;
+    
+    if (!sc)
+        return xmalloc (n);
+    lstats.slab_allocs++;
+    if (sc->free) {
+        p = sc->free;
+        sc->free = sc->free->next;
+        return p;
+    }
+    if (sc->end - sc->next < sc->size)
+        slab_grow (sc);
+    p = sc->next;
+    sc->next += sc->size;
+    return p;
+#endif /* !DMALLOC */
+}
+
+void
+slab_free (void *p, size_t n)
+{
+#if DMALLOC
+    free (p);
+#else /* !DMALLOC */
+    struct slab_cache *sc = n <= SLAB_MAX ? slab_cache (n, 0) : NULL;
+    struct slab_obj *o = p;
+    
+    if (!p)
+        return;
+    if (!sc) {
+        free (p);
+        return;
+    }
+    lstats.slab_frees++;
+    o->next = sc->free;
+    sc->free = o;
+#endif /* !DMALLOC */
+}
+
 #if NEED_CLOCK_GETTIME
 int
 clock_gettime (int id, struct timespec *tp)
@@ -145,48 +427,643 @@ print_pkt (const packet_t *buf, const char *op, int n)
     errno = saved_errno;
 }
 
-int
-conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+/* -d: the packet trace (see trace.h).  One ring for the whole
+ * process; threads claim records with an atomic add. */
+static struct trace_rec *trace_ring;
+static uint64_t trace_head;
+static char *opt_trace;			/* --trace: dump here */
+
+void
+conn_trace (conn_t *c, int type, uint32_t seqno, uint32_t ackno, int len)
+{
+    struct trace_rec *t;
+    struct timespec ts;
+    
+    if (!trace_ring)
+        return;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    t = &trace_ring[__atomic_fetch_add (&trace_head, 1, __ATOMIC_RELAXED)
+                    & (TRACE_RING - 1)];
+    t->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    t->conn = c ? c->id : 0;
+    t->seqno = seqno;
+    t->ackno = ackno;
+    t->len = len;
+    t->type = type;
+    t->shard = shard_id < 0 ? 0 : shard_id;
+}
+
+/* Trace a packet still in network byte order */
+static void
+trace_pkt (conn_t *c, int type, const packet_t *pkt, int len)
+{
+    conn_trace (c, type, len >= 12 && ntohs (pkt->len) >= 12
+                ? ntohl (pkt->seqno) : 0, ntohl (pkt->ackno), len);
+}
+
+/* Write out the ring.  This only makes async-signal-safe calls, so the
+ * signal handlers can use it. */
+static void
+trace_dump (void)
+{
+    struct trace_hdr h;
+    struct timespec ts;
+    const char *p;
+    size_t left;
+    ssize_t n;
+    int fd;
+    
+    if (!trace_ring
+        || (fd = open (opt_trace, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+        return;
+    memset (&h, 0, sizeof (h));
+    memcpy (h.magic, TRACE_MAGIC, sizeof (h.magic));
+    h.rec_size = sizeof (struct trace_rec);
+    h.ring_size = TRACE_RING;
+    h.head = __atomic_load_n (&trace_head, __ATOMIC_RELAXED);
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    h.mono_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    clock_gettime (CLOCK_REALTIME, &ts);
+    h.real_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (write (fd, &h, sizeof (h)) == sizeof (h))
+        for (p = (const char *) trace_ring, left = TRACE_RING * sizeof (*trace_ring);
+             left > 0 && (n = write (fd, p, left)) > 0; p += n, left -= n)
+            ;
+    close (fd);
+}
+
+/* SIGUSR2 takes a snapshot; SIGINT and SIGTERM still kill us, after
+ * one last dump. */
+static void
+trace_signal (int sig)
+{
+    trace_dump ();
+    if (sig != SIGUSR2) {
+        signal (sig, SIG_DFL);
+        raise (sig);
+    }
+}
+
+static void
+trace_init (void)
+{
+    struct sigaction sa;
+    
+    if (!opt_trace) {
+        opt_trace = xmalloc (strlen (progname) + 32);
+        sprintf (opt_trace, "%s.%d.trace", progname, (int) getpid ());
+    }
+    trace_ring = xmalloc (TRACE_RING * sizeof (*trace_ring));
+    memset (trace_ring, 0, TRACE_RING * sizeof (*trace_ring));
+    atexit (trace_dump);
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = trace_signal;
+    sigaction (SIGUSR2, &sa, NULL);
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+    fprintf (stderr, "[tracing to %s]\n", opt_trace);
+}
+
+/* Reference-counted packet buffers, from the slab.  Unused ones sit on
+ * a free list of their own (one that keeps refs and needs no size), so
+ * once the pool has grown to the most packets ever held at once nothing
+ * gets allocated. */
+struct pktbuf {
+    struct pktbuf *next;	/* free list */
+    int refs;
+    packet_t pkt;		/* last: pkt_size bytes, see above */
+};
+static __thread struct pktbuf *pktbuf_free;
+
+static struct pktbuf *
+pktbuf_of (packet_t *pkt)
+{
+    return (struct pktbuf *) ((char *) pkt - offsetof (struct pktbuf, pkt));
+}
+
+static packet_t *
+pkt_alloc (void)
+{
+    struct pktbuf *b = pktbuf_free;
+    if (b)
+        pktbuf_free = b->next;
+    else
+        b = slab_alloc (offsetof (struct pktbuf, pkt) + pkt_size);
+    b->refs = 1;
+    return &b->pkt;
+}
+
+packet_t *
+pkt_hold (packet_t *pkt)
+{
+    pktbuf_of (pkt)->refs++;
+    return pkt;
+}
+
+void
+pkt_release (packet_t *pkt)
+{
+    struct pktbuf *b = pktbuf_of (pkt);
+    assert (b->refs > 0);
+    if (--b->refs == 0) {
+        b->next = pktbuf_free;
+        pktbuf_free = b;
+    }
+}
+
+/* The protocol is done with rx_pkts[i].  If it held on to the buffer,
+ * put a new one in its place for the next recvmmsg. */
+static void
+rx_recycle (int i, int poison)
+{
+    if (pktbuf_of (rx_pkts[i])->refs > 1) {
+        pkt_release (rx_pkts[i]);
+        rx_pkts[i] = pkt_alloc ();
+        rx_iovs[i].iov_base = rx_pkts[i];
+    }
+#ifndef NDEBUG
+    else
+        memset (rx_pkts[i], poison, rx_msgs[i].msg_len); /* to help debugging */
+#endif /* !NDEBUG */
+}
+
+#if USE_EPOLL
+static int
+ev_ctl (int op, struct evsrc *e)
+{
+    struct epoll_event ev;
+    memset (&ev, 0, sizeof (ev));
+    ev.events = e->events;
+    ev.data.ptr = e;
+    return epoll_ctl (epfd, op, e->fd, &ev);
+}
+
+/* epoll refuses regular files, which poll simply reports as always
+ * ready.  Go back to poll for good; conn_mkevents rebuilds everything
+ * from the connections' state. */
+static void
+ev_fallback (void)
+{
+    if (opt_debug)
+        fprintf (stderr, "[epoll unusable, falling back to poll]\n");
+    close (epfd);
+    epfd = -1;
+    use_epoll = 0;
+    cevents_generation++;
+}
+
+static void
+ev_add (struct evsrc *e, conn_t *c, int fd, uint32_t events)
+{
+    e->c = c;
+    e->fd = fd;
+    e->events = events;
+    if (ev_ctl (EPOLL_CTL_ADD, e) < 0) {
+        e->fd = -1;
+        if (errno == EPERM)
+            ev_fallback ();
+        else
+            perror ("epoll_ctl");
+    }
+}
+
+static void
+ev_set (struct evsrc *e, uint32_t bit, int on)
+{
+    uint32_t events = on ? e->events | bit : e->events & ~bit;
+    if (e->fd < 0 || events == e->events)
+        return;
+    e->events = events;
+    if (ev_ctl (EPOLL_CTL_MOD, e) < 0)
+        perror ("epoll_ctl");
+}
+
+static void
+ev_del (struct evsrc *e)
+{
+    if (e->fd < 0)
+        return;
+    ev_ctl (EPOLL_CTL_DEL, e);
+    e->fd = -1;
+}
+
+static void
+ev_init (void)
+{
+    if ((epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+        perror ("epoll_create1");
+        use_epoll = 0;
+        return;
+    }
+    /* Do catch errors on stderr (unless it is a file) */
+    stderr_ev.fd = 2;
+    if (ev_ctl (EPOLL_CTL_ADD, &stderr_ev) < 0)
+        stderr_ev.fd = -1;
+}
+
+/* epoll and poll use the same bit values on Linux, but don't count on
+ * it. */
+static int
+ev_revents (uint32_t events)
+{
+    return ((events & EPOLLIN ? POLLIN : 0)
+            | (events & EPOLLOUT ? POLLOUT : 0)
+            | (events & EPOLLERR ? POLLERR : 0)
+            | (events & EPOLLHUP ? POLLHUP : 0));
+}
+#endif /* USE_EPOLL */
+
+/* Turn interest in input on c->rfd on or off */
+static void
+conn_want_read (conn_t *c, int on)
+{
+#if USE_EPOLL
+    if (use_epoll) {
+        ev_set (&c->rev, EPOLLIN, on);
+        return;
+    }
+#endif /* USE_EPOLL */
+    if (!c->rpoll)
+        return;
+    if (on)
+        cevents[c->rpoll].events |= POLLIN;
+    else
+        cevents[c->rpoll].events &= ~POLLIN;
+}
+
+/* Turn interest in c->wfd becoming writable on or off */
+static void
+conn_want_write (conn_t *c, int on)
+{
+#if USE_EPOLL
+    if (use_epoll) {
+        ev_set (c->wfd == c->rfd ? &c->rev : &c->wev, EPOLLOUT, on);
+        return;
+    }
+#endif /* USE_EPOLL */
+    if (!c->wpoll)
+        return;
+    if (on)
+        cevents[c->wpoll].events |= POLLOUT;
+    else
+        cevents[c->wpoll].events &= ~POLLOUT;
+}
+
+static int
+fd_is_tcp (int fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof (ss);
+    int type;
+    socklen_t tlen = sizeof (type);
+    
+    if (getsockopt (fd, SOL_SOCKET, SO_TYPE, &type, &tlen) < 0
+        || type != SOCK_STREAM
+        || getsockname (fd, (struct sockaddr *) &ss, &len) < 0)
+        return 0;
+    return ss.ss_family == AF_INET || ss.ss_family == AF_INET6;
+}
+
+/* Whether the loop reads c->nfd itself.  A server's UDP socket is
+ * shared and read by conn_demux, and the I/O thread reads its own. */
+static int
+conn_polls_nfd (const conn_t *c)
+{
+    return !c->server && !io_owns (c->nfd);
+}
+
+/* Start watching a connection's descriptors, once rfd, wfd and nfd are
+ * all set.  The poll backend picks it up from conn_list instead. */
+static void
+conn_register (conn_t *c)
+{
+    c->wtcp = fd_is_tcp (c->wfd);
+#if USE_EPOLL
+    if (use_epoll)
+        ev_add (&c->rev, c, c->rfd, c->xoff ? 0 : EPOLLIN);
+    if (use_epoll && c->wfd != c->rfd)
+        ev_add (&c->wev, c, c->wfd, c->outused ? EPOLLOUT : 0);
+    if (use_epoll && conn_polls_nfd (c))
+        ev_add (&c->nev, c, c->nfd, EPOLLIN);
+#endif /* USE_EPOLL */
+}
+
+/* Watch the accept or UDP socket; see listen_ready. */
+static void
+conn_listen (int fd)
+{
+    listen_fd = fd;
+#if USE_EPOLL
+    if (use_epoll)
+        ev_add (&listen_ev, NULL, fd, EPOLLIN);
+#endif /* USE_EPOLL */
+    cevents_generation++;
+}
+
+static void
+gso_alloc (struct gso_batch *g, int batch)
+{
+    if (!udp_gso)
+        return;
+    g->msgs = xmalloc (batch * sizeof (*g->msgs));
+    g->nsegs = xmalloc (batch * sizeof (*g->nsegs));
+    g->cmsgs = xmalloc (batch * sizeof (*g->cmsgs));
+    memset (g->msgs, 0, batch * sizeof (*g->msgs));
+    memset (g->cmsgs, 0, batch * sizeof (*g->cmsgs));
+}
+
+/* sendmmsg for n datagrams of one iovec each, whose iovecs are
+ * consecutive elements of one array (as tx_flush and io_send have
+ * them).  With GSO, each run of datagrams for the same address, all
+ * the size of the first but the last (which may be shorter), becomes
+ * one message.  Returns how many datagrams went, or -1 if the first
+ * did not. */
+static int
+udp_sendmmsg (int s, struct mmsghdr *msgs, int n, struct gso_batch *g)
+{
+#if USE_GSO
+    int i, j, k, sent;
+    
+    if (!g->msgs || !__atomic_load_n (&udp_gso, __ATOMIC_RELAXED))
+        return sendmmsg (s, msgs, n, 0);
+    for (i = k = 0; i < n; i = j, k++) {
+        struct msghdr *first = &msgs[i].msg_hdr;
+        struct msghdr *h = &g->msgs[k].msg_hdr;
+        size_t seg = first->msg_iov->iov_len, total = seg;
+        
+        for (j = i + 1; j < n && j - i < GSO_MAX_SEGS; j++) {
+            struct msghdr *m = &msgs[j].msg_hdr;
+            size_t len = m->msg_iov->iov_len;
+            if (len > seg || total + len > GSO_MAX_BYTES
+                || m->msg_namelen != first->msg_namelen
+                || (m->msg_namelen
+                    && memcmp (m->msg_name, first->msg_name, m->msg_namelen)))
+                break;
+            total += len;
+            if (len < seg) {
+                j++;
+                break;
+            }
+        }
+        h->msg_name = first->msg_name;
+        h->msg_namelen = first->msg_namelen;
+        h->msg_iov = first->msg_iov;
+        h->msg_iovlen = j - i;
+        if (j - i > 1) {
+            struct cmsghdr *cm = (struct cmsghdr *) g->cmsgs[k];
+            cm->cmsg_level = IPPROTO_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN (sizeof (uint16_t));
+            *(uint16_t *) CMSG_DATA (cm) = seg;
+            h->msg_control = cm;
+            h->msg_controllen = sizeof (g->cmsgs[k]);
+        }
+        else {
+            h->msg_control = NULL;
+            h->msg_controllen = 0;
+        }
+        g->nsegs[k] = j - i;
+    }
+    if (k == n)
+        return sendmmsg (s, msgs, n, 0);
+    sent = sendmmsg (s, g->msgs, k, 0);
+    if (sent < 0 && g->nsegs[0] > 1
+        && (errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+        /* EIO: the device can't checksum for us */
+        if (__atomic_exchange_n (&udp_gso, 0, __ATOMIC_RELAXED))
+            fprintf (stderr, "[UDP GSO off: %s]\n", strerror (errno));
+        return sendmmsg (s, msgs, n, 0);
+    }
+    if (sent < 0 && g->nsegs[0] > 1 && errno == EINVAL)
+        /* Segments too large for the route, say; only this batch */
+        return sendmmsg (s, msgs, n, 0);
+    if (sent <= 0)
+        return sent;
+    for (i = n = 0; i < sent; i++)
+        n += g->nsegs[i];
+    return n;
+#else /* !USE_GSO */
+    (void) g;
+    return sendmmsg (s, msgs, n, 0);
+#endif /* !USE_GSO */
+}
+
+/* Kernels before 4.18 skip a cmsg they don't know, and would send each
+ * run as one big datagram; only use GSO where the option exists. */
+static void
+gso_probe (void)
+{
+#if USE_GSO
+    int s = socket (AF_INET, SOCK_DGRAM, 0);
+    int v;
+    socklen_t len = sizeof (v);
+    
+    if (s < 0 || getsockopt (s, IPPROTO_UDP, UDP_SEGMENT, &v, &len) < 0)
+        udp_gso = 0;
+    if (s >= 0)
+        close (s);
+#endif /* USE_GSO */
+}
+
+static packet_t *
+tx_pkt (int i)
+{
+    return (packet_t *) (tx_bufs + i * pkt_size);
+}
+
+static void
+tx_alloc (int batch)
+{
+    int i;
+    
+    tx_batch = batch;
+    tx_bufs = xmalloc (batch * pkt_size);
+    tx_addrs = xmalloc (batch * sizeof (*tx_addrs));
+    tx_fds = xmalloc (batch * sizeof (*tx_fds));
+    tx_iovs = xmalloc (batch * sizeof (*tx_iovs));
+    tx_msgs = xmalloc (batch * sizeof (*tx_msgs));
+    memset (tx_msgs, 0, batch * sizeof (*tx_msgs));
+    for (i = 0; i < batch; i++) {
+        tx_iovs[i].iov_base = tx_pkt (i);
+        tx_msgs[i].msg_hdr.msg_iov = &tx_iovs[i];
+        tx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    gso_alloc (&tx_gso, batch);
+}
+
+/* Send everything queued, in order.  Each run of consecutive packets
+ * for the same socket takes one sendmmsg, and with GSO each run of
+ * those for one peer takes one message.  A packet the kernel refuses
+ * is reported and dropped like any lost datagram; the protocol will
+ * retransmit it. */
+static void
+tx_flush (void)
+{
+    int i = 0, run, n;
+    
+    while (i < tx_count) {
+        for (run = 1; i + run < tx_count && tx_fds[i + run] == tx_fds[i]; run++)
+            ;
+        n = udp_sendmmsg (tx_fds[i], &tx_msgs[i], run, &tx_gso);
+        if (n < 0) {
+            /* The first packet of the run failed; the rest may not */
+            if (errno != EAGAIN)
+                perror ("sendmmsg");
+            trace_pkt (NULL, TR_DROP, tx_pkt (i), tx_iovs[i].iov_len);
+            n = 1;
+        }
+        i += n;
+    }
+    tx_count = 0;
+}
+
+/* Queue pkt for sending, or send it now if alone or not batching */
+static int
+conn_send (conn_t *c, const packet_t *pkt, size_t len, int alone)
 {
     int n;
     assert (!c->delete_me);
+    c->pkts_sent++;
+    c->bytes_sent += len;
+    lstats.pkts_sent++;
+    lstats.bytes_sent += len;
+    if (trace_ring)
+        trace_pkt (c, TR_SEND, pkt, len);
+    if (iot && !alone)
+        return io_sendpkt (c, pkt, len);
+    if (tx_batch && !alone) {
+        struct msghdr *h = &tx_msgs[tx_count].msg_hdr;
+        if (len > pkt_size) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        memcpy (tx_pkt (tx_count), pkt, len);
+        tx_iovs[tx_count].iov_len = len;
+        tx_fds[tx_count] = c->nfd;
+        if (c->server) {
+            tx_addrs[tx_count] = c->peer;
+            h->msg_name = &tx_addrs[tx_count];
+            h->msg_namelen = addrsize (&c->peer);
+        }
+        else {
+            h->msg_name = NULL;
+            h->msg_namelen = 0;
+        }
+        if (++tx_count == tx_batch)
+            tx_flush ();
+        return len;
+    }
     if (c->server)
         n = sendto (c->nfd, pkt, len, 0,
                     (const struct sockaddr *) &c->peer, addrsize (&c->peer));
     else
         n = send (c->nfd, pkt, len, 0);
-    if (opt_debug)
-        print_pkt (pkt, "send", n);
+    if (n < 0 && trace_ring)
+        trace_pkt (c, TR_DROP, pkt, len);
     return n;
 }
 
+int
+conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+{
+    return conn_send (c, pkt, len, 0);
+}
+
+int
+conn_sendprobe (conn_t *c, const packet_t *pkt, size_t len)
+{
+    return conn_send (c, pkt, len, 1);
+}
+
 size_t
 conn_bufspace (conn_t *c)
 {
-    chunk_t *ch;
-    size_t used = 0;
-    const size_t bufsize = 8192;
+    return c->outsize - c->outused;
+}
+
+/* Append n bytes, which must fit, to the output ring */
+static void
+outq_put (conn_t *c, const char *buf, size_t n)
+{
+    size_t tail = (c->outhead + c->outused) % c->outsize;
+    size_t first = c->outsize - tail;
+    
+    if (first > n)
+        first = n;
+    memcpy (c->outq + tail, buf, first);
+    memcpy (c->outq, buf + first, n - first);
+    c->outused += n;
+}
+
+/* Append the bytes of iov from offset skip on, up to n of them, to the
+ * output ring */
+static void
+outq_putv (conn_t *c, const struct iovec *iov, int iovcnt,
+           size_t skip, size_t n)
+{
+    int i;
     
+    for (i = 0; i < iovcnt && n > 0; i++) {
+        size_t len = iov[i].iov_len;
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+        len -= skip;
+        if (len > n)
+            len = n;
+        outq_put (c, (const char *) iov[i].iov_base + skip, len);
+        n -= len;
+        skip = 0;
+    }
+}
+
+static int
+conn_writev (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr m;
+    
+    if (!rx_pending || !c->wtcp)
+        return writev (c->wfd, iov, iovcnt);
+    
+    /* More of this batch may be for us; don't send a short segment */
+    if (!c->corked) {
+        c->corked = 1;
+        cork_conns[ncork++] = c;
+    }
+    memset (&m, 0, sizeof (m));
+    m.msg_iov = (struct iovec *) iov;
+    m.msg_iovlen = iovcnt;
+    return sendmsg (c->wfd, &m, MSG_MORE);
+}
+
+/* Push out whatever MSG_MORE held back during the last batch */
+static void
+conn_uncork (void)
+{
+    int i, off = 0;
     
-    for (ch = c->outq; ch; ch = ch->next)
-        used += (ch->size - ch->used);
-    return used > bufsize ? 0 : bufsize - used;
+    rx_pending = 0;
+    for (i = 0; i < ncork; i++) {
+        setsockopt (cork_conns[i]->wfd, IPPROTO_TCP, TCP_CORK,
+                    &off, sizeof (off));
+        cork_conns[i]->corked = 0;
+    }
+    ncork = 0;
 }
 
 int
-conn_output (conn_t *c, const void *_buf, size_t _n)
+conn_outputv (conn_t *c, const struct iovec *iov, int iovcnt)
 {
-    const char *buf = _buf;
-    int n = _n;
+    size_t n = 0, done = 0;
+    int i;
     
     assert (!c->delete_me && !c->write_eof);
     
-    if (n == 0) {
-        c->write_eof = 1;
-        if (!c->outq)
-            shutdown (c->wfd, SHUT_WR);
+    for (i = 0; i < iovcnt; i++)
+        n += iov[i].iov_len;
+    if (n == 0)
         return 0;
-    }
     
     if (c->write_err) {
         if (c->write_err == 2)
@@ -198,11 +1075,8 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
     if (!conn_bufspace (c))
         return 0;
     
-    if (log_out >= 0)
-        write (log_out, buf, n);
-    
-    if (!c->outq) {
-        int r = write (c->wfd, buf, n);
+    if (!c->outused) {
+        int r = conn_writev (c, iov, iovcnt);
         if (r < 0) {
             if (errno != EAGAIN) {
                 perror ("write");
@@ -210,25 +1084,51 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
                 return -1;
             }
         }
-        else {
-            buf += r;
-            n -= r;
+        else
+            done = r;
+    }
+    
+    /* Queue whatever fits of the rest */
+    if (done < n) {
+        size_t q = n - done;
+        if (q > conn_bufspace (c))
+            q = conn_bufspace (c);
+        outq_putv (c, iov, iovcnt, done, q);
+        done += q;
+    }
+    c->bytes_out += done;
+    
+    if (log_out >= 0) {
+        size_t left = done;
+        for (i = 0; i < iovcnt && left > 0; i++) {
+            size_t len = iov[i].iov_len < left ? iov[i].iov_len : left;
+            write (log_out, iov[i].iov_base, len);
+            left -= len;
         }
     }
     
-    if (n > 0) {
-        chunk_t *ch = xmalloc (offsetof (chunk_t, buf[n]));
-        ch->next = NULL;
-        ch->size = n;
-        ch->used = 0;
-        memcpy (ch->buf, buf, n);
-        *c->outqtail = ch;
-        c->outqtail = &ch->next;
+    if (c->outused)
+        conn_want_write (c, 1);
+    return done;
+}
+
+int
+conn_output (conn_t *c, const void *buf, size_t n)
+{
+    struct iovec iov;
+    
+    assert (!c->delete_me && !c->write_eof);
+    
+    if (n == 0) {
+        c->write_eof = 1;
+        if (!c->outused)
+            shutdown (c->wfd, SHUT_WR);
+        return 0;
     }
     
-    if (c->wpoll && c->outq)
-        cevents[c->wpoll].events |= POLLOUT;
-    return _n;
+    iov.iov_base = (void *) buf;
+    iov.iov_len = n;
+    return conn_outputv (c, &iov, 1);
 }
 
 int
@@ -237,6 +1137,7 @@ conn_input (conn_t *c, void *buf, size_t n)
     int r;
     assert (!c->delete_me);
     
+    c->did_read = 1;
     if (c->read_eof)
         return -1;
     r = read (c->rfd, buf, n);
@@ -250,22 +1151,28 @@ conn_input (conn_t *c, void *buf, size_t n)
     if (r < 0 && errno == EAGAIN)
         r = 0;
     
+    c->bytes_in += r;
     if (r > 0 && log_in >= 0)
         write (log_in, buf, r);
     
-    c->xoff = 0;
-    cevents[c->rpoll].events |= POLLIN;
+    if (c->xoff) {
+        c->xoff = 0;
+        conn_want_read (c, 1);
+    }
     return r;
 }
 
 static conn_t *
-conn_alloc (void)
+conn_alloc (const struct config_common *cc)
 {
-    conn_t *c = xmalloc (sizeof (*c));
+    conn_t *c = slab_alloc (sizeof (*c));
     memset (c, 0, sizeof (*c));
     c->prev = &conn_list;
     c->next = conn_list;
-    c->outqtail = &c->outq;
+    c->outsize = cc->outbuf;
+    c->outq = slab_alloc (c->outsize);
+    c->rev.fd = c->wev.fd = c->nev.fd = -1;
+    c->id = ++lstats.conns_opened;
     if (conn_list)
         conn_list->prev = &c->next;
     conn_list = c;
@@ -299,12 +1206,13 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
         return NULL;
     }
     
-    c = conn_alloc ();
+    c = conn_alloc (&serverconf->c);
     c->peer = *ss;
     c->rel = rel;
     c->nfd = serverconf->udp_socket;
     c->rfd = c->wfd = n;
     c->server = 1;
+    conn_register (c);
     
     return c;
 }
@@ -312,17 +1220,17 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
 static void
 conn_free (conn_t *c)
 {
-    chunk_t *ch, *nch;
-    
-    for (ch = c->outq; ch; ch = nch) {
-        nch = ch->next;
-        free (ch);
-    }
+    slab_free (c->outq, c->outsize);
     
     if (c->next)
         c->next->prev = c->prev;
     *c->prev = c->next;
     
+#if USE_EPOLL
+    ev_del (&c->rev);
+    ev_del (&c->wev);
+    ev_del (&c->nev);
+#endif /* USE_EPOLL */
     close (c->rfd);
     if (c->wfd != c->rfd)
         close (c->wfd);
@@ -333,7 +1241,7 @@ conn_free (conn_t *c)
     
     /* to help catch errors */
     memset (c, 0xc5, sizeof (*c));
-    free (c);
+    slab_free (c, sizeof (*c));
 }
 
 void
@@ -345,36 +1253,43 @@ conn_destroy (conn_t *c)
 void
 conn_drain (conn_t *c)
 {
-    chunk_t *ch;
     int didsome = 0;
     
-    if (c->wpoll)
-        cevents[c->wpoll].events &= ~POLLOUT;
+    conn_want_write (c, 0);
     
     if (c->write_err)
         return;
     
-    while ((ch = c->outq)) {
-        int n = write (c->wfd, ch->buf + ch->used,
-                       ch->size - ch->used);
+    if (c->outused) {
+        /* The ring is at most two pieces: head to the end, then from
+         * the start */
+        struct iovec iov[2];
+        int n, cnt = 1;
+        iov[0].iov_base = c->outq + c->outhead;
+        iov[0].iov_len = c->outsize - c->outhead;
+        if (iov[0].iov_len >= c->outused)
+            iov[0].iov_len = c->outused;
+        else {
+            iov[1].iov_base = c->outq;
+            iov[1].iov_len = c->outused - iov[0].iov_len;
+            cnt = 2;
+        }
+        n = writev (c->wfd, iov, cnt);
         if (n < 0) {
             if (errno != EAGAIN)
                 c->write_err = 1;
-            break;
         }
-        didsome = 1;
-        ch->used += n;
-        if (ch->used < ch->size) {
-            if (c->wpoll)
-                cevents[c->wpoll].events |= POLLOUT;
-            break;
+        else {
+            didsome = 1;
+            c->outhead = (c->outhead + n) % c->outsize;
+            c->outused -= n;
+            if (c->outused)
+                conn_want_write (c, 1);
         }
-        c->outq = ch->next;
-        if (!c->outq)
-            c->outqtail = &c->outq;
-        free (ch);
     }
-    if (c->write_eof && !c->write_err && !c->outq) {
+    if (!c->outused)
+        c->outhead = 0;
+    if (c->write_eof && !c->write_err && !c->outused) {
         c->write_err = 1;
         shutdown (c->wfd, SHUT_WR);
     }
@@ -382,12 +1297,151 @@ conn_drain (conn_t *c)
         rel_output (c->rel);
 }
 
+static void
+stats_signal (int sig)
+{
+    stats_requests++;
+}
+
+/* Only there to end a shard's wait */
+static void
+wake_signal (int sig)
+{
+}
+
+/* Write one line for the loop, then one per connection, each a keyword
+ * followed by name=value fields.  Byte and packet counts are totals
+ * since the connection (or loop) started. */
+static void
+stats_write (FILE *f)
+{
+    conn_t *c;
+    int nconns = 0, nclosing = 0;
+    
+    /* Destroyed ones only wait for their output to drain before
+     * conn_reap frees them */
+    for (c = conn_list; c; c = c->next)
+        if (c->delete_me)
+            nclosing++;
+        else
+            nconns++;
+    fprintf (f, "loop shard=%d conns=%d closing=%d conns_opened=%llu"
+             " pkts_recv=%llu bytes_recv=%llu pkts_sent=%llu bytes_sent=%llu"
+             " mallocs=%llu slab_allocs=%llu slab_frees=%llu"
+             " slab_chunks=%llu slab_huge=%llu\n",
+             shard_id < 0 ? 0 : shard_id, nconns, nclosing,
+             (unsigned long long) lstats.conns_opened,
+             (unsigned long long) lstats.pkts_recv,
+             (unsigned long long) lstats.bytes_recv,
+             (unsigned long long) lstats.pkts_sent,
+             (unsigned long long) lstats.bytes_sent,
+             (unsigned long long) lstats.mallocs,
+             (unsigned long long) lstats.slab_allocs,
+             (unsigned long long) lstats.slab_frees,
+             (unsigned long long) lstats.slab_chunks,
+             (unsigned long long) lstats.slab_huge);
+    for (c = conn_list; c; c = c->next) {
+        char addr[NI_MAXHOST] = "unknown";
+        char port[NI_MAXSERV] = "unknown";
+        struct rel_stats rs;
+        
+        if (c->delete_me)
+            continue;
+        rel_stats (c->rel, &rs);
+        getnameinfo ((const struct sockaddr *) &c->peer, addrsize (&c->peer),
+                     addr, sizeof (addr), port, sizeof (port),
+                     NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
+        fprintf (f, "conn id=%llu peer=%s:%s"
+                 " pkts_sent=%llu bytes_sent=%llu pkts_recv=%llu bytes_recv=%llu"
+                 " retransmits=%llu cksum_errors=%llu duplicates=%llu"
+                 " out_of_order=%llu window=%d srtt_us=%ld max_packet=%d"
+                 " outq=%zu bytes_in=%llu bytes_out=%llu\n",
+                 (unsigned long long) c->id, addr, port,
+                 (unsigned long long) c->pkts_sent,
+                 (unsigned long long) c->bytes_sent,
+                 (unsigned long long) rs.pkts_recv,
+                 (unsigned long long) rs.bytes_recv,
+                 (unsigned long long) rs.retransmits,
+                 (unsigned long long) rs.cksum_errors,
+                 (unsigned long long) rs.duplicates,
+                 (unsigned long long) rs.out_of_order,
+                 rs.window, rs.srtt, rs.max_packet, c->outused,
+                 (unsigned long long) c->bytes_in,
+                 (unsigned long long) c->bytes_out);
+    }
+}
+
+/* Dump the stats to fd with a single write, so that dumps from several
+ * shards to stderr don't interleave. */
+static void
+stats_dump (int fd)
+{
+    char *buf = NULL;
+    size_t len = 0, off = 0;
+    FILE *f = open_memstream (&buf, &len);
+    ssize_t n;
+    
+    if (!f) {
+        perror ("open_memstream");
+        return;
+    }
+    stats_write (f);
+    fclose (f);
+    while (off < len && (n = write (fd, buf + off, len - off)) > 0)
+        off += n;
+    free (buf);
+}
+
+/* Answer everyone waiting on the stats socket */
+static void
+stats_serve (void)
+{
+    struct timeval tv = { 0, 100000 };
+    int s;
+    
+    while ((s = accept (stats_fd, NULL, NULL)) >= 0) {
+        /* Don't let a reader that never reads stall the loop */
+        setsockopt (s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+        stats_dump (s);
+        close (s);
+    }
+    if (errno != EAGAIN)
+        perror ("accept");
+}
+
+/* Listen for stats readers on path (path.N for shard N) */
+static void
+stats_listen (const char *path)
+{
+    struct sockaddr_storage ss;
+    struct stat sb;
+    char *name = xmalloc (strlen (path) + 16);
+    
+    if (shard_id >= 0)
+        sprintf (name, "%s.%d", path, shard_id);
+    else
+        strcpy (name, path);
+    /* Clear out a socket left behind by an earlier run */
+    if (lstat (name, &sb) == 0 && S_ISSOCK (sb.st_mode))
+        unlink (name);
+    if (get_address (&ss, 1, 0, AF_UNIX, name) < 0
+        || (stats_fd = listen_on (0, &ss)) < 0)
+        exit (1);
+    free (name);
+    make_async (stats_fd);
+#if USE_EPOLL
+    if (use_epoll)
+        ev_add (&stats_ev, NULL, stats_fd, EPOLLIN);
+#endif /* USE_EPOLL */
+    cevents_generation++;
+}
+
 static void
 conn_mkevents (void)
 {
     struct pollfd *e;
     conn_t **r, **w;
-    size_t n = 2;
+    size_t n = 3;
     conn_t *c;
     
     for (c = conn_list; c; c = c->next) {
@@ -407,19 +1461,28 @@ conn_mkevents (void)
             else
                 c->wpoll = n++;
         }
-        if (c->server)
-            c->npoll = 0;
-        else
+        if (conn_polls_nfd (c))
             c->npoll = n++;
+        else
+            c->npoll = 0;
     }
     
-    e = xmalloc (n * sizeof (*e));
+    if (n > cevents_size) {
+        cevents_size = n > 2 * cevents_size ? n : 2 * cevents_size;
+        free (cevents);
+        free (evreaders);
+        free (evwriters);
+        cevents = xmalloc (cevents_size * sizeof (*cevents));
+        evreaders = xmalloc (cevents_size * sizeof (*evreaders));
+        evwriters = xmalloc (cevents_size * sizeof (*evwriters));
+    }
+    e = cevents;
     memset (e, 0, n * sizeof (*e));
-    if (cevents)
-        e[0] = cevents[0];
-    else
-        e[0].fd = -1;
+    e[0].fd = listen_fd;
+    e[0].events = POLLIN;
     e[1].fd = 2;			/* Do catch errors on stderr */
+    e[2].fd = stats_fd;
+    e[2].events = POLLIN;
     
     for (c = conn_list; c; c = c->next) {
         if (c->rpoll) {
@@ -429,7 +1492,7 @@ conn_mkevents (void)
         }
         if (c->wpoll) {
             e[c->wpoll].fd = c->wfd;
-            if (c->outq)
+            if (c->outused)
                 e[c->wpoll].events |= POLLOUT;
         }
         if (c->npoll) {
@@ -438,9 +1501,9 @@ conn_mkevents (void)
         }
     }
     
-    r = xmalloc (n * sizeof (*r));
+    r = evreaders;
     memset (r, 0, n * sizeof (*r));
-    w = xmalloc (n * sizeof (*w));
+    w = evwriters;
     memset (w, 0, n * sizeof (*w));
     for (c = conn_list; c; c = c->next) {
         if (c->rpoll > 0)
@@ -451,105 +1514,379 @@ conn_mkevents (void)
             w[c->wpoll] = c;
     }
     
-    free (cevents);
-    cevents = e;
     ncevents = n;
-    free (evreaders);
-    evreaders = r;
-    free (evwriters);
-    evwriters = w;
 }
 
 static void
 conn_demux (const struct config_server *cs)
 {
-    packet_t pkt;
-    struct sockaddr_storage ss;
-    int n;
-    
-    memset (&ss, 0, sizeof (ss));
-    while ((n = debug_recv (cs->udp_socket, &pkt, sizeof (pkt), 0, &ss)) >= 0) {
-        rel_demux (&cs->c, &ss, &pkt, n);
-        memset (&pkt, 0xc7, n);	     /* to help debugging */
-        memset (&ss, 0x7c, sizeof (ss)); /* to help debugging */
+    int i, n;
+    
+    while ((n = rx_recvmmsg (cs->udp_socket, 1)) > 0) {
+        for (i = 0; i < n; i++) {
+            rx_pending = i + 1 < n;
+            lstats.pkts_recv++;
+            lstats.bytes_recv += rx_msgs[i].msg_len;
+            rel_demux (&cs->c, &rx_addrs[i], rx_pkts[i], rx_msgs[i].msg_len);
+            rx_recycle (i, 0xc7);
+#ifndef NDEBUG
+            memset (&rx_addrs[i], 0x7c, sizeof (rx_addrs[i])); /* to help debugging */
+#endif /* !NDEBUG */
+        }
+        conn_uncork ();
+        /* A short batch means the socket is drained; don't spend a
+         * system call finding that out. */
+        if (n < rx_batch)
+            return;
     }
-    if (errno != EAGAIN)
+    if (n < 0 && errno != EAGAIN)
         perror ("UDP recv");
 }
 
-long
-need_timer_in (const struct timespec *last, long timer)
+/* Timers live in a hierarchical timing wheel with 1 ms ticks.  Level 0
+ * has one slot for each of the next 256 ms.  Each of the three levels
+ * above has 64 slots, and each slot covers a whole turn of the level
+ * below, so the wheel reaches out about 18 hours.  A timer goes in the
+ * finest level that reaches its deadline.  It moves down a level (it
+ * "cascades") when the level below comes round to its slot.
+ *
+ * Setting and cancelling a timer is O(1).  A run only touches timers
+ * that expire or cascade, and it skips empty stretches using the busy
+ * bitmap.  The loop sleeps until the next deadline, or indefinitely
+ * when no timer is pending. */
+#define WHEEL_BITS0 8
+#define WHEEL_BITS 6
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOTS0 (1 << WHEEL_BITS0)
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_FIRING (WHEEL_SLOTS0 + (WHEEL_LEVELS - 1) * WHEEL_SLOTS)
+#define WHEEL_SPAN (1ULL << (WHEEL_BITS0 + (WHEEL_LEVELS - 1) * WHEEL_BITS))
+
+struct wheel_slot {
+    struct timer *head;
+    struct timer **tail;
+};
+
+struct wheel {
+    uint64_t time;		/* next tick to run */
+    uint64_t now;		/* clock at the last wake-up, in ms */
+    uint64_t now_us;		/* the same, in microseconds */
+    int pending;
+    /* Slot WHEEL_FIRING holds the timers of the tick being run */
+    struct wheel_slot slots[WHEEL_FIRING + 1];
+    uint64_t busy[(WHEEL_FIRING + 63) / 64];	/* non-empty slots */
+};
+static __thread struct wheel wheel;
+
+/* The one clock read per loop iteration */
+static void
+clock_read (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    wheel.now_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    wheel.now = wheel.now_us / 1000;
+}
+
+static void
+wheel_init (void)
+{
+    int i;
+    
+    clock_read ();
+    wheel.time = wheel.now;
+    for (i = 0; i <= WHEEL_FIRING; i++)
+        wheel.slots[i].tail = &wheel.slots[i].head;
+}
+
+/* Shift of the bits that pick a slot in level (>= 1) */
+static int
+wheel_shift (int level)
+{
+    return WHEEL_BITS0 + (level - 1) * WHEEL_BITS;
+}
+
+static void
+wheel_put (struct timer *t, int slot)
+{
+    struct wheel_slot *s = &wheel.slots[slot];
+    t->slot = slot;
+    t->next = NULL;
+    t->prev = s->tail;
+    *s->tail = t;
+    s->tail = &t->next;
+    if (slot < WHEEL_FIRING)
+        wheel.busy[slot / 64] |= 1ULL << (slot % 64);
+}
+
+/* File t by its deadline */
+static void
+wheel_add (struct timer *t)
+{
+    uint64_t d;
+    int level;
+    
+    if (t->expires < wheel.time)
+        t->expires = wheel.time;
+    d = t->expires - wheel.time;
+    if (d >= WHEEL_SPAN)
+        t->expires = wheel.time + (d = WHEEL_SPAN - 1);
+    if (d < WHEEL_SLOTS0) {
+        wheel_put (t, t->expires & (WHEEL_SLOTS0 - 1));
+        return;
+    }
+    for (level = 1; d >> wheel_shift (level) >= WHEEL_SLOTS; level++)
+        ;
+    wheel_put (t, WHEEL_SLOTS0 + (level - 1) * WHEEL_SLOTS
+               + ((t->expires >> wheel_shift (level)) & (WHEEL_SLOTS - 1)));
+}
+
+static void
+wheel_unlink (struct timer *t)
+{
+    struct wheel_slot *s = &wheel.slots[t->slot];
+    *t->prev = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    else
+        s->tail = t->prev;
+    if (!s->head && t->slot < WHEEL_FIRING)
+        wheel.busy[t->slot / 64] &= ~(1ULL << (t->slot % 64));
+    t->prev = NULL;
+}
+
+/* Move every timer in slot to slot to (if >= 0), or back into the
+ * wheel by deadline */
+static void
+wheel_move (int slot, int to)
+{
+    struct timer *t;
+    while ((t = wheel.slots[slot].head)) {
+        wheel_unlink (t);
+        if (to >= 0)
+            wheel_put (t, to);
+        else
+            wheel_add (t);
+    }
+}
+
+/* First busy slot in [from, to), or to */
+static int
+wheel_next_busy (int from, int to)
+{
+    while (from < to) {
+        uint64_t w = wheel.busy[from / 64] >> (from % 64);
+        if (w) {
+            from += __builtin_ctzll (w);
+            return from < to ? from : to;
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return to;
+}
+
+void
+timer_init (struct timer *t, void (*fn) (struct timer *))
+{
+    memset (t, 0, sizeof (*t));
+    t->fn = fn;
+}
+
+void
+timer_set (struct timer *t, long ms)
+{
+    timer_cancel (t);
+    t->expires = wheel.now + (ms > 0 ? ms : 0);
+    wheel_add (t);
+    wheel.pending++;
+}
+
+void
+timer_cancel (struct timer *t)
+{
+    if (!t->prev)
+        return;
+    wheel_unlink (t);
+    wheel.pending--;
+}
+
+uint64_t
+timer_now (void)
+{
+    return wheel.now;
+}
+
+uint64_t
+timer_now_us (void)
+{
+    return wheel.now_us;
+}
+
+/* How long the loop may sleep: until the next deadline, or the next
+ * cascade if anything sits above level 0 (which may bring an earlier
+ * one down).  -1 if nothing is pending. */
+static int
+timer_timeout (void)
+{
+    int idx = wheel.time & (WHEEL_SLOTS0 - 1);
+    uint64_t next = UINT64_MAX;
+    int p;
+    
+    if (!wheel.pending)
+        return -1;
+    if ((p = wheel_next_busy (idx, WHEEL_SLOTS0)) < WHEEL_SLOTS0)
+        next = wheel.time + (p - idx);
+    else if ((p = wheel_next_busy (0, idx)) < idx)
+        next = wheel.time + (WHEEL_SLOTS0 - idx + p);
+    if (wheel_next_busy (WHEEL_SLOTS0, WHEEL_FIRING) < WHEEL_FIRING
+        && (wheel.time | (WHEEL_SLOTS0 - 1)) + 1 < next)
+        next = (wheel.time | (WHEEL_SLOTS0 - 1)) + 1;
+    if (next <= wheel.now)
+        return 0;
+    return next - wheel.now > INT_MAX ? INT_MAX : next - wheel.now;
+}
+
+/* Read the clock on waking up, before anything that was waiting runs,
+ * so timers it sets are measured from now and not from before the
+ * sleep. */
+static void
+timer_wake (void)
+{
+    clock_read ();
+}
+
+/* Fire everything that was due when timer_wake read the clock */
+static void
+timer_run (void)
+{
+    while (wheel.time <= wheel.now) {
+        int idx = wheel.time & (WHEEL_SLOTS0 - 1);
+        int level, next;
+        struct timer *t;
+        
+        if (!wheel.pending) {
+            wheel.time = wheel.now + 1;
+            break;
+        }
+        if (idx == 0)
+            for (level = 1; level < WHEEL_LEVELS; level++) {
+                int i = (wheel.time >> wheel_shift (level)) & (WHEEL_SLOTS - 1);
+                wheel_move (WHEEL_SLOTS0 + (level - 1) * WHEEL_SLOTS + i, -1);
+                if (i != 0)
+                    break;
+            }
+        next = wheel_next_busy (idx, WHEEL_SLOTS0);
+        if (next > idx) {
+            /* Nothing due until slot next (or the next turn) */
+            if (wheel.time + (next - idx) > wheel.now + 1)
+                wheel.time = wheel.now + 1;
+            else
+                wheel.time += next - idx;
+            continue;
+        }
+        /* Run this tick's timers.  Anything set from a callback lands
+         * in a later tick, because the wheel has moved on. */
+        wheel_move (idx, WHEEL_FIRING);
+        wheel.time++;
+        while ((t = wheel.slots[WHEEL_FIRING].head)) {
+            timer_cancel (t);
+            t->fn (t);
+        }
+    }
+}
+
+/* An ICMP port unreachable came back for c's peer */
+static void
+conn_unreachable (const struct config_common *cc, conn_t *c)
+{
+    char addr[NI_MAXHOST] = "unknown";
+    char port[NI_MAXSERV] = "unknown";
+    getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
+                 addr, sizeof (addr), port, sizeof (port),
+                 NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
+    fprintf (stderr, "[received ICMP port unreachable;"
+             " assuming peer at %s:%s is dead]\n", addr, port);
+    if (cc->single_connection)
+        exit (1);
+    rel_destroy (c->rel);
+}
+
+/* Handle revents (as from poll) on fd, which rc reads from and wc
+ * writes to; either may be NULL. */
+static void
+conn_dispatch (const struct config_common *cc, int fd, int revents,
+               conn_t *rc, conn_t *wc)
+{
+    conn_t *c = rc;
+    
+    if ((revents & (POLLIN|POLLERR|POLLHUP)) && c && !c->delete_me) {
+        if (fd == c->rfd) {
+            /* Stop watching only if the protocol took nothing (its
+             * window is full); conn_input starts again. */
+            c->did_read = 0;
+            rel_read (c->rel);
+            if (!c->did_read && !c->xoff && !c->delete_me) {
+                c->xoff = 1;
+                conn_want_read (c, 0);
+            }
+        }
+        else if (fd == c->nfd && (revents & (POLLERR|POLLHUP)))
+            conn_unreachable (cc, c);
+        else if (fd == c->nfd && !c->server) {
+            int j, n = rx_recvmmsg (c->nfd, 0);
+            if (n < 0) {
+                if (errno != EAGAIN)
+                    perror ("recv");
+            }
+            for (j = 0; j < n && !c->delete_me; j++) {
+                rx_pending = j + 1 < n;
+                lstats.pkts_recv++;
+                lstats.bytes_recv += rx_msgs[j].msg_len;
+                rel_recvpkt (c->rel, rx_pkts[j], rx_msgs[j].msg_len);
+                rx_recycle (j, 0xc9);
+            }
+            conn_uncork ();
+        }
+    }
+    if ((revents & (POLLOUT|POLLHUP|POLLERR)) && wc)
+        conn_drain (wc);
+}
+
+/* poll, letting SIGWAKE in while it waits (see wait_mask) */
+static int
+loop_wait (struct pollfd *fds, nfds_t n, int timeout)
 {
-    long to;
     struct timespec ts;
     
-    clock_gettime (CLOCK_MONOTONIC, &ts);
-    to = ts.tv_sec - last->tv_sec;
-    if (to > timer / 1000)
-        return 0;
-    to = to * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-    if (to >= timer)
-        return 0;
-    return
-    timer - to;
+    if (!wait_mask)
+        return poll (fds, n, timeout);
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = timeout % 1000 * 1000000L;
+    return ppoll (fds, n, timeout < 0 ? NULL : &ts, wait_mask);
 }
 
-void
-conn_poll (const struct config_common *cc)
+static void
+conn_pollfds (const struct config_common *cc, int timeout)
 {
-    //int n, i;
-    int  i;
-    conn_t *c, *nc;
-    static int last_cg;
+    int i;
     
     if (last_cg != cevents_generation) {
         conn_mkevents ();
-        cevents_generation = last_cg;
+        last_cg = cevents_generation;
     }
     
     if (cevents[0].fd >= 0)
-        poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
+        loop_wait (cevents, ncevents, timeout);
     else
-        poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
+        loop_wait (cevents+1, ncevents-1, timeout);
+    timer_wake ();
+    listen_ready = cevents[0].revents != 0;
+    if (cevents[2].revents & POLLIN)
+        stats_serve ();
     
     for (i = 1; i < ncevents; i++) {
-        if (cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
-            if ((c = evreaders[i]) && !c->delete_me) {
-                if (cevents[i].fd == c->rfd) {
-                    c->xoff = 1;
-                    cevents[i].events &= ~POLLIN;
-                    rel_read (c->rel);
-                }
-                else if (cevents[i].fd == c->nfd
-                         && (cevents[i].revents & (POLLERR|POLLHUP))) {
-                    char addr[NI_MAXHOST] = "unknown";
-                    char port[NI_MAXSERV] = "unknown";
-                    getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
-                                 addr, sizeof (addr), port, sizeof (port),
-                                 NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
-                    fprintf (stderr, "[received ICMP port unreachable;"
-                             " assuming peer at %s:%s is dead]\n", addr, port);
-                    if (cc->single_connection)
-                        exit (1);
-                    rel_destroy (c->rel);
-                }
-                else if (cevents[i].fd == c->nfd && !c->server) {
-                    packet_t pkt;
-                    int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL);
-                    if (len < 0) {
-                        if (errno != EAGAIN)
-                            perror ("recv");
-                    }
-                    else {
-                        rel_recvpkt (c->rel, &pkt, len);
-                        memset (&pkt, 0xc9, len); /* for debugging */
-                    }
-                }
-            }
-        }
-        if ((cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
-            && evwriters[i])
-            conn_drain (evwriters[i]);
+        conn_dispatch (cc, cevents[i].fd, cevents[i].revents,
+                       evreaders[i], evwriters[i]);
         if (cevents[i].revents & (POLLHUP|POLLERR)) {
 #if 0
             fprintf (stderr, "%5d Error on fd %d (0x%x)\n",
@@ -563,32 +1900,241 @@ conn_poll (const struct config_common *cc)
         }
         cevents[i].revents = 0;
     }
-    
-    if (need_timer_in (&last_timeout, cc->timer) == 0) {
-        rel_timer ();
-        clock_gettime (CLOCK_MONOTONIC, &last_timeout);
+}
+
+#if USE_EPOLL
+/* Only ready descriptors come back, so this costs nothing per idle
+ * connection. */
+static void
+conn_epoll (const struct config_common *cc, int timeout)
+{
+    struct epoll_event ev[EP_MAXEVENTS];
+    int i, n;
+    
+    n = epoll_pwait (epfd, ev, EP_MAXEVENTS, timeout, wait_mask);
+    if (n < 0 && errno != EINTR)
+        perror ("epoll_wait");
+    timer_wake ();
+    listen_ready = 0;
+    
+    for (i = 0; i < n; i++) {
+        struct evsrc *e = ev[i].data.ptr;
+        int revents = ev_revents (ev[i].events);
+        conn_t *c = e->c;
+        
+        if (e == &listen_ev) {
+            listen_ready = 1;
+            continue;
+        }
+        if (e == &stats_ev) {
+            stats_serve ();
+            continue;
+        }
+        if (e->fd < 0)
+            continue;
+        if (c)
+            conn_dispatch (cc, e->fd, revents,
+                           e->fd == c->rfd || e->fd == c->nfd ? c : NULL,
+                           e->fd == c->wfd ? c : NULL);
+        if (revents & (POLLHUP|POLLERR)) {
+            /* If stderr has an error, the tester has probably died, so exit
+             * immediately. */
+            if (e == &stderr_ev)
+                exit (1);
+            ev_del (e);
+        }
     }
+}
+#endif /* USE_EPOLL */
+
+/* Free the connections rel_destroy is done with, once their output
+ * has gone.  Call this after anything that may destroy one, since the
+ * next wait may be a long one. */
+static void
+conn_reap (void)
+{
+    conn_t *c, *nc;
+    
+    /* Before any connection (and so its socket) goes away */
+    if (tx_count)
+        tx_flush ();
+    if (iot)
+        io_flush ();
     
     for (c = conn_list; c; c = nc) {
         nc = c->next;
-        if (c->delete_me && (c->write_err || !c->outq))
+        if (c->delete_me && (c->write_err || !c->outused))
             conn_free (c);
     }
 }
 
-uint16_t
-cksum (const void *_data, int len)
+void
+conn_poll (const struct config_common *cc)
+{
+    int timeout;
+    
+    /* Whatever the caller sent since the last call goes out before we
+     * go to sleep. */
+    if (tx_count)
+        tx_flush ();
+    if (iot)
+        io_flush ();
+    
+    /* Measured from when timer_wake last read the clock, so a timer may
+     * fire late by however long the work since then took. */
+    timeout = timer_timeout ();
+#if USE_EPOLL
+    if (use_epoll)
+        conn_epoll (cc, timeout);
+    else
+#endif /* USE_EPOLL */
+        conn_pollfds (cc, timeout);
+    
+    if (stats_seen != stats_requests) {
+        stats_seen = stats_requests;
+        stats_dump (2);
+    }
+    
+    timer_run ();
+    conn_reap ();
+}
+
+/* The Internet checksum doesn't care about byte order (RFC 1071): sum
+ * the data as native 16-bit words and the result is just the
+ * byte-swapped big-endian sum.  So these add up whole machine words (or
+ * vectors) in native order and leave the folding to cksum_fold. */
+static uint64_t
+cksum_words (const unsigned char *data, size_t len)
 {
-    const uint8_t *data = _data;
-    uint32_t sum;
+    uint64_t sum = 0, q;
+    uint32_t w;
+    uint16_t h;
     
-    for (sum = 0;len >= 2; data += 2, len -= 2)
-        sum += data[0] << 8 | data[1];
-    if (len > 0)
-        sum += data[0] << 8;
+    for (; len >= 8; data += 8, len -= 8) {
+        memcpy (&q, data, 8);
+        sum += (q & 0xffffffff) + (q >> 32);
+    }
+    if (len >= 4) {
+        memcpy (&w, data, 4);
+        sum += w;
+        data += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        memcpy (&h, data, 2);
+        sum += h;
+        data += 2;
+        len -= 2;
+    }
+    if (len > 0) {
+        /* A trailing odd byte counts as the high-order byte of a
+         * big-endian word, i.e., the first byte in memory */
+        unsigned char last[2] = { data[0], 0 };
+        memcpy (&h, last, 2);
+        sum += h;
+    }
+    return sum;
+}
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define CKSUM_SIMD 1
+#include <immintrin.h>
+
+/* 32-bit lanes can take this many vectors of 16-bit words without
+ * overflowing, before they have to be added into the 64-bit sum. */
+#define CKSUM_BLOCK 32768
+
+__attribute__ ((target ("sse2")))
+static uint64_t
+cksum_sse2 (const unsigned char *data, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    uint64_t sum = 0;
+    uint32_t lanes[4];
+    
+    while (len >= 16) {
+        __m128i acc = zero;
+        size_t n = len / 16 > CKSUM_BLOCK ? CKSUM_BLOCK : len / 16;
+        for (len -= n * 16; n > 0; n--, data += 16) {
+            __m128i v = _mm_loadu_si128 ((const __m128i *) data);
+            acc = _mm_add_epi32 (acc, _mm_unpacklo_epi16 (v, zero));
+            acc = _mm_add_epi32 (acc, _mm_unpackhi_epi16 (v, zero));
+        }
+        _mm_storeu_si128 ((__m128i *) lanes, acc);
+        sum += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return sum + cksum_words (data, len);
+}
+
+__attribute__ ((target ("avx2")))
+static uint64_t
+cksum_avx2 (const unsigned char *data, size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256 ();
+    uint64_t sum = 0;
+    uint32_t lanes[8];
+    int i;
+    
+    while (len >= 32) {
+        __m256i acc = zero;
+        size_t n = len / 32 > CKSUM_BLOCK ? CKSUM_BLOCK : len / 32;
+        for (len -= n * 32; n > 0; n--, data += 32) {
+            __m256i v = _mm256_loadu_si256 ((const __m256i *) data);
+            acc = _mm256_add_epi32 (acc, _mm256_unpacklo_epi16 (v, zero));
+            acc = _mm256_add_epi32 (acc, _mm256_unpackhi_epi16 (v, zero));
+        }
+        _mm256_storeu_si256 ((__m256i *) lanes, acc);
+        for (i = 0; i < 8; i++)
+            sum += lanes[i];
+    }
+    return sum + cksum_words (data, len);
+}
+#endif /* __GNUC__ && x86 */
+
+static uint64_t cksum_pick (const unsigned char *data, size_t len);
+static __thread uint64_t (*cksum_sum) (const unsigned char *, size_t) = cksum_pick;
+
+/* First call: settle on the best routine this CPU can run */
+static uint64_t
+cksum_pick (const unsigned char *data, size_t len)
+{
+    cksum_sum = cksum_words;
+#if CKSUM_SIMD
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2"))
+        cksum_sum = cksum_avx2;
+    else if (__builtin_cpu_supports ("sse2"))
+        cksum_sum = cksum_sse2;
+#endif /* CKSUM_SIMD */
+    return cksum_sum (data, len);
+}
+
+static uint16_t
+cksum_fold (uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
     while (sum > 0xffff)
-        sum = (sum >> 16) + (sum & 0xffff);
-    sum = htons (~sum);
+        sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+uint16_t
+cksum (const void *_data, int len)
+{
+    uint16_t sum = ~cksum_fold (cksum_sum (_data, len > 0 ? len : 0));
+    return sum ? sum : 0xffff;
+}
+
+uint16_t
+cksum_update (uint16_t sum, const void *old, const void *new, int len)
+{
+    /* RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m').  In ones' complement
+     * the sum of the ~m is ~(sum of the m). */
+    uint64_t s = (uint16_t) ~sum;
+    s += (uint16_t) ~cksum_fold (cksum_words (old, len));
+    s += cksum_words (new, len);
+    sum = ~cksum_fold (s);
     return sum ? sum : 0xffff;
 }
 
@@ -650,37 +2196,92 @@ addrsize (const struct sockaddr_storage *ss)
     abort ();
 }
 
-static inline unsigned int
-hash_bytes (const void *_key, int len, unsigned int seed)
+/* Random per-process key, so nobody can pick addresses that all land
+ * in the same bucket of a hash table. */
+static uint64_t addrhash_key[2];
+
+static void
+addrhash_init (void)
+{
+    int fd = open ("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read (fd, addrhash_key, sizeof (addrhash_key))
+        != sizeof (addrhash_key)) {
+        struct timespec ts;
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        addrhash_key[0] = ts.tv_nsec ^ ((uint64_t) getpid () << 32);
+        addrhash_key[1] = ts.tv_sec ^ (uint64_t) (uintptr_t) &ts;
+    }
+    if (fd >= 0)
+        close (fd);
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND						\
+    do {							\
+        v0 += v1; v1 = ROTL (v1, 13); v1 ^= v0; v0 = ROTL (v0, 32);	\
+        v2 += v3; v3 = ROTL (v3, 16); v3 ^= v2;			\
+        v0 += v3; v3 = ROTL (v3, 21); v3 ^= v0;			\
+        v2 += v1; v1 = ROTL (v1, 17); v1 ^= v2; v2 = ROTL (v2, 32);	\
+    } while (0)
+
+/* SipHash-2-4 */
+static uint64_t
+siphash (const void *_in, size_t len, const uint64_t k[2])
 {
-    const unsigned char *key = (const unsigned char *) _key;
-    const unsigned char *end;
-    
-    for (end = key + len; key < end; key++)
-        seed = ((seed << 5) + seed) ^ *key;
-    return seed;
+    const unsigned char *in = _in;
+    uint64_t v0 = k[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k[1] ^ 0x7465646279746573ULL;
+    uint64_t b = (uint64_t) len << 56;
+    uint64_t m;
+    size_t i;
+    
+    for (; len >= 8; in += 8, len -= 8) {
+        for (m = 0, i = 0; i < 8; i++)
+            m |= (uint64_t) in[i] << (8 * i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    for (i = 0; i < len; i++)
+        b |= (uint64_t) in[i] << (8 * i);
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
 }
+
 unsigned int
 addrhash (const struct sockaddr_storage *ss)
 {
-    unsigned int r = 5381;
+    unsigned char key[18];
     switch (ss->ss_family) {
         case AF_INET:
         {
             const struct sockaddr_in *s = (const struct sockaddr_in *) ss;
-            r = hash_bytes (&s->sin_port, 2, r);
-            return hash_bytes (&s->sin_addr, 4, r);
+            memcpy (key, &s->sin_port, 2);
+            memcpy (key + 2, &s->sin_addr, 4);
+            return siphash (key, 6, addrhash_key);
         }
         case AF_INET6:
         {
             const struct sockaddr_in6 *s = (const struct sockaddr_in6 *) ss;
-            r = hash_bytes (&s->sin6_port, 2, r);
-            return hash_bytes (&s->sin6_addr, 16, r);
+            memcpy (key, &s->sin6_port, 2);
+            memcpy (key + 2, &s->sin6_addr, 16);
+            return siphash (key, 18, addrhash_key);
         }
         case AF_UNIX:
         {
             const struct sockaddr_un *s = (const struct sockaddr_un *) ss;
-            return hash_bytes (s->sun_path, strlen (s->sun_path), r);
+            return siphash (s->sun_path, strlen (s->sun_path), addrhash_key);
         }
     }
     fprintf (stderr, "addrhash: unknown address family %d\n",
@@ -749,8 +2350,35 @@ get_address (struct sockaddr_storage *ss, int local,
     return 0;
 }
 
-int
-listen_on (int dgram, struct sockaddr_storage *ss)
+/* With -m, a probe too big for the path must be lost, not fragmented:
+ * set DF, and leave the kernel's own path MTU estimate out of it.  The
+ * default socket buffers only hold a few of the largest datagrams, so
+ * make room for a window of them (as far as net.core.rmem_max lets
+ * us). */
+static void
+udp_pmtud (int s, int family)
+{
+    int v;
+    
+    if (!opt_pmtud)
+        return;
+    setsockopt (s, SOL_SOCKET, SO_RCVBUF, &udp_bufsize, sizeof (udp_bufsize));
+    setsockopt (s, SOL_SOCKET, SO_SNDBUF, &udp_bufsize, sizeof (udp_bufsize));
+#ifdef IP_PMTUDISC_PROBE
+    v = IP_PMTUDISC_PROBE;
+    if (family == AF_INET)
+        setsockopt (s, IPPROTO_IP, IP_MTU_DISCOVER, &v, sizeof (v));
+#endif /* IP_PMTUDISC_PROBE */
+#ifdef IPV6_PMTUDISC_PROBE
+    v = IPV6_PMTUDISC_PROBE;
+    if (family == AF_INET6)
+        setsockopt (s, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &v, sizeof (v));
+#endif /* IPV6_PMTUDISC_PROBE */
+    (void) v;
+}
+
+static int
+listen_on_opt (int dgram, struct sockaddr_storage *ss, int reuseport)
 {
     int type = dgram ? SOCK_DGRAM : SOCK_STREAM;
     int s = socket (ss->ss_family, type, 0);
@@ -765,6 +2393,14 @@ listen_on (int dgram, struct sockaddr_storage *ss)
     }
     if (!dgram)
         setsockopt (s, SOL_SOCKET, SO_REUSEADDR, (char *) &n, sizeof (n));
+    else
+        udp_pmtud (s, ss->ss_family);
+    if (reuseport
+        && setsockopt (s, SOL_SOCKET, SO_REUSEPORT, (char *) &n, sizeof (n)) < 0) {
+        perror ("SO_REUSEPORT");
+        close (s);
+        return -1;
+    }
     if (bind (s, (const struct sockaddr *) ss, addrsize (ss)) < 0) {
         perror ("bind");
         close (s);
@@ -803,6 +2439,12 @@ listen_on (int dgram, struct sockaddr_storage *ss)
     return s;
 }
 
+int
+listen_on (int dgram, struct sockaddr_storage *ss)
+{
+    return listen_on_opt (dgram, ss, 0);
+}
+
 int
 connect_to (int dgram, const struct sockaddr_storage *ss)
 {
@@ -812,6 +2454,8 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
         perror ("socket");
         return -1;
     }
+    if (dgram)
+        udp_pmtud (s, ss->ss_family);
     make_async (s);
     if (connect (s, (struct sockaddr *) ss, addrsize (ss)) < 0
         && errno != EINPROGRESS) {
@@ -823,32 +2467,406 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
     return s;
 }
 
+static void
+rx_alloc (int batch)
+{
+    int i;
+    
+    rx_batch = batch;
+    rx_pkts = xmalloc (batch * sizeof (*rx_pkts));
+    rx_addrs = xmalloc (batch * sizeof (*rx_addrs));
+    rx_iovs = xmalloc (batch * sizeof (*rx_iovs));
+    rx_msgs = xmalloc (batch * sizeof (*rx_msgs));
+    cork_conns = xmalloc (batch * sizeof (*cork_conns));
+    memset (rx_msgs, 0, batch * sizeof (*rx_msgs));
+    for (i = 0; i < batch; i++) {
+        rx_pkts[i] = pkt_alloc ();
+        rx_iovs[i].iov_base = rx_pkts[i];
+        rx_iovs[i].iov_len = pkt_size;
+        rx_msgs[i].msg_hdr.msg_iov = &rx_iovs[i];
+        rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+/* Receive up to rx_batch datagrams from s into rx_pkts (and their
+ * source addresses into rx_addrs if want_from).  Returns the number of
+ * datagrams, whose lengths are in rx_msgs[i].msg_len, or -1. */
+static int
+rx_recvmmsg (int s, int want_from)
+{
+    int i;
+    for (i = 0; i < rx_batch; i++) {
+        rx_msgs[i].msg_hdr.msg_name = want_from ? &rx_addrs[i] : NULL;
+        rx_msgs[i].msg_hdr.msg_namelen = want_from ? sizeof (rx_addrs[i]) : 0;
+    }
+    return recvmmsg (s, rx_msgs, rx_batch, 0, NULL);
+}
+
+
+/* Pipelined I/O (-I).  A second thread owns the UDP socket and does
+ * every recvmmsg and sendmmsg on it, so the protocol thread running
+ * rel_recvpkt, rel_read and the timers never waits on the socket.  The
+ * two trade work through three single-producer, single-consumer rings:
+ *
+ *   rx    I/O thread -> loop   datagrams received, in pool buffers
+ *   free  loop -> I/O thread   empty pool buffers to receive into
+ *   tx    loop -> I/O thread   datagrams to send, copied in
+ *
+ * All IO_RING pool buffers are always in free, in rx, or being
+ * received into, so rx never fills up.  The I/O thread never touches
+ * reference counts; only the loop allocates and releases buffers.
+ *
+ * Nobody takes a lock.  A producer writes slots, then publishes them by
+ * advancing head; a consumer reads them, then hands them back by
+ * advancing tail.  Each side gets woken through an eventfd, and only
+ * when a ring it had emptied gets something in it again. */
+
+#define IO_RING 256		/* power of 2 */
+
+struct spsc {
+    unsigned head;		/* written only by the producer */
+    char pad1[64 - sizeof (unsigned)];
+    unsigned tail;		/* written only by the consumer */
+    char pad2[64 - sizeof (unsigned)];
+};
+
+struct io_rxslot {
+    packet_t *pkt;
+    int len;			/* or -1 if the peer was unreachable */
+    struct sockaddr_storage addr;	/* server only */
+};
+
+struct io_txslot {
+    packet_t *pkt;		/* pkt_size bytes */
+    int len;
+    socklen_t addrlen;		/* 0 on a connected socket */
+    struct sockaddr_storage addr;
+};
+
+struct iothr {
+    struct spsc rx, free, tx;
+    struct io_rxslot rxs[IO_RING];
+    packet_t *frees[IO_RING];
+    struct io_txslot txs[IO_RING];
+    int sock;			/* the UDP socket */
+    int from;			/* unconnected: want source addresses */
+    int batch;			/* datagrams per system call */
+    int loop_efd;		/* rx has something again */
+    int io_efd;			/* tx or free has something again */
+    int tx_staged;		/* loop only: written to txs, not yet in tx */
+    const struct config_common *cc;
+    pthread_t thread;
+};
+
+/* Producer: slots free to write, starting at r->head */
+static unsigned
+spsc_space (struct spsc *r)
+{
+    return IO_RING - (r->head - __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE));
+}
+
+/* Producer: make n more slots visible.  Returns nonzero if the
+ * consumer had taken everything before, and so may be asleep. */
+static int
+spsc_push (struct spsc *r, unsigned n)
+{
+    unsigned head = r->head;
+    __atomic_store_n (&r->head, head + n, __ATOMIC_RELEASE);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    return __atomic_load_n (&r->tail, __ATOMIC_RELAXED) == head;
+}
+
+/* Consumer: slots ready to read, starting at r->tail */
+static unsigned
+spsc_avail (struct spsc *r)
+{
+    return __atomic_load_n (&r->head, __ATOMIC_ACQUIRE) - r->tail;
+}
+
+/* Consumer: give n slots back */
+static void
+spsc_pop (struct spsc *r, unsigned n)
+{
+    __atomic_store_n (&r->tail, r->tail + n, __ATOMIC_RELEASE);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+static void
+io_kick (int efd)
+{
+    uint64_t one = 1;
+    if (write (efd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+        perror ("eventfd");
+}
+
+static void
+io_unkick (int efd)
+{
+    uint64_t n;
+    if (read (efd, &n, sizeof (n)) < 0 && errno != EAGAIN)
+        perror ("eventfd");
+}
+
 static int
-debug_recv (int s, packet_t *buf, size_t len, int flags,
-            struct sockaddr_storage *from)
+io_owns (int fd)
+{
+    return iot && iot->sock == fd;
+}
+
+/* I/O thread: send everything in tx */
+static void
+io_send (struct iothr *io, struct mmsghdr *msgs, struct iovec *iovs,
+         struct gso_batch *gso)
+{
+    unsigned i, k;
+    int n;
+    
+    while ((k = spsc_avail (&io->tx)) > 0) {
+        if (k > (unsigned) io->batch)
+            k = io->batch;
+        for (i = 0; i < k; i++) {
+            struct io_txslot *t = &io->txs[(io->tx.tail + i) & (IO_RING - 1)];
+            iovs[i].iov_base = t->pkt;
+            iovs[i].iov_len = t->len;
+            msgs[i].msg_hdr.msg_name = t->addrlen ? &t->addr : NULL;
+            msgs[i].msg_hdr.msg_namelen = t->addrlen;
+        }
+        n = udp_sendmmsg (io->sock, msgs, k, gso);
+        if (n < 0) {
+            /* Dropped, like any lost datagram; see tx_flush */
+            if (errno != EAGAIN && errno != ECONNREFUSED)
+                perror ("sendmmsg");
+            trace_pkt (NULL, TR_DROP, iovs[0].iov_base, iovs[0].iov_len);
+            n = 1;
+        }
+        spsc_pop (&io->tx, n);
+    }
+}
+
+/* I/O thread: receive into free buffers until the socket is drained or
+ * we run out.  Out of buffers, there is nothing to do but wait for the
+ * loop to give some back. */
+static void
+io_recv (struct iothr *io, struct mmsghdr *msgs, struct iovec *iovs)
 {
-    socklen_t socklen = sizeof (*from);
+    unsigned i, k;
     int n;
-    if (from)
-        n = recvfrom (s, buf, len, flags, (struct sockaddr *) from, &socklen);
+    
+    while ((k = spsc_avail (&io->free)) > 0) {
+        if (k > (unsigned) io->batch)
+            k = io->batch;
+        for (i = 0; i < k; i++) {
+            struct io_rxslot *r = &io->rxs[(io->rx.head + i) & (IO_RING - 1)];
+            r->pkt = io->frees[(io->free.tail + i) & (IO_RING - 1)];
+            iovs[i].iov_base = r->pkt;
+            iovs[i].iov_len = pkt_size;
+            msgs[i].msg_hdr.msg_name = io->from ? &r->addr : NULL;
+            msgs[i].msg_hdr.msg_namelen = io->from ? sizeof (r->addr) : 0;
+        }
+        n = recvmmsg (io->sock, msgs, k, 0, NULL);
+        if (n < 0 && errno == ECONNREFUSED) {
+            /* Pass it on in the first buffer */
+            io->rxs[io->rx.head & (IO_RING - 1)].len = -1;
+            n = 1;
+        }
+        else if (n < 0) {
+            if (errno != EAGAIN)
+                perror ("UDP recv");
+            return;
+        }
+        else
+            for (i = 0; i < (unsigned) n; i++)
+                io->rxs[(io->rx.head + i) & (IO_RING - 1)].len = msgs[i].msg_len;
+        spsc_pop (&io->free, n);
+        if (spsc_push (&io->rx, n))
+            io_kick (io->loop_efd);
+        if ((unsigned) n < k)
+            return;
+    }
+}
+
+static void *
+io_main (void *_io)
+{
+    struct iothr *io = _io;
+    struct mmsghdr *msgs = xmalloc (io->batch * sizeof (*msgs));
+    struct iovec *iovs = xmalloc (io->batch * sizeof (*iovs));
+    struct gso_batch gso;
+    struct pollfd p[2];
+    int i;
+    
+    memset (&gso, 0, sizeof (gso));
+    gso_alloc (&gso, io->batch);
+    memset (msgs, 0, io->batch * sizeof (*msgs));
+    for (i = 0; i < io->batch; i++) {
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    p[0].fd = io->sock;
+    p[1].fd = io->io_efd;
+    p[1].events = POLLIN;
+    for (;;) {
+        io_send (io, msgs, iovs, &gso);
+        io_recv (io, msgs, iovs);
+        /* Only wait for the socket if there is a buffer to receive
+         * into; the loop kicks us when it hands some back. */
+        p[0].events = spsc_avail (&io->free) ? POLLIN : 0;
+        if (poll (p, 2, -1) < 0 && errno != EINTR)
+            perror ("poll");
+        if (p[1].revents)
+            io_unkick (io->io_efd);
+    }
+    return NULL;
+}
+
+/* Loop: queue a datagram for the I/O thread.  Like a full socket
+ * buffer, a full ring drops it. */
+static int
+io_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+{
+    struct io_txslot *t;
+    
+    if (len > pkt_size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (spsc_space (&iot->tx) == (unsigned) iot->tx_staged) {
+        io_flush ();
+        if (spsc_space (&iot->tx) == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    t = &iot->txs[(iot->tx.head + iot->tx_staged) & (IO_RING - 1)];
+    memcpy (t->pkt, pkt, len);
+    t->len = len;
+    if (c->server) {
+        t->addr = c->peer;
+        t->addrlen = addrsize (&c->peer);
+    }
     else
-        n = recv (s, buf, len, flags);
-    if (opt_debug)
-        print_pkt (buf, "recv", n);
-    return n;
+        t->addrlen = 0;
+    /* A full batch goes now, so the I/O thread sends while we work */
+    if (++iot->tx_staged == iot->batch)
+        io_flush ();
+    return len;
+}
+
+/* Loop: hand the I/O thread what io_sendpkt queued */
+static void
+io_flush (void)
+{
+    if (!iot->tx_staged)
+        return;
+    if (spsc_push (&iot->tx, iot->tx_staged))
+        io_kick (iot->io_efd);
+    iot->tx_staged = 0;
+}
+
+/* Loop: run what the I/O thread received through the protocol, then
+ * give it the buffers back (or fresh ones for those the protocol kept).
+ * Called when loop_efd is readable. */
+static void
+io_demux (void)
+{
+    struct iothr *io = iot;
+    unsigned i, n;
+    
+    io_unkick (io->loop_efd);
+    while ((n = spsc_avail (&io->rx)) > 0) {
+        for (i = 0; i < n; i++) {
+            struct io_rxslot *r = &io->rxs[(io->rx.tail + i) & (IO_RING - 1)];
+            packet_t *pkt = r->pkt;
+            rx_pending = i + 1 < n;
+            if (r->len >= 0) {
+                lstats.pkts_recv++;
+                lstats.bytes_recv += r->len;
+            }
+            if (io->from)
+                rel_demux (io->cc, &r->addr, pkt, r->len);
+            else if (!conn_list || conn_list->delete_me)
+                ;
+            else if (r->len < 0)
+                conn_unreachable (io->cc, conn_list);
+            else
+                rel_recvpkt (conn_list->rel, pkt, r->len);
+            if (pktbuf_of (pkt)->refs > 1) {
+                pkt_release (pkt);
+                pkt = pkt_alloc ();
+            }
+#ifndef NDEBUG
+            else if (r->len > 0)
+                memset (pkt, 0xcb, r->len); /* to help debugging */
+#endif /* !NDEBUG */
+            io->frees[(io->free.head + i) & (IO_RING - 1)] = pkt;
+        }
+        spsc_pop (&io->rx, n);
+        if (spsc_push (&io->free, n))
+            io_kick (io->io_efd);
+        conn_uncork ();
+    }
+}
+
+/* Start an I/O thread on sock for this loop.  from says sock is
+ * unconnected, so received datagrams need their source addresses.  The
+ * loop should then watch iot->loop_efd and call io_demux. */
+static void
+io_start (const struct config_common *cc, int sock, int from)
+{
+    struct iothr *io = xmalloc (sizeof (*io));
+    int i, err;
+    
+    memset (io, 0, sizeof (*io));
+    io->sock = sock;
+    io->from = from;
+    io->batch = cc->send_batch > cc->batch ? cc->send_batch : cc->batch;
+    io->cc = cc;
+    io->loop_efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    io->io_efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io->loop_efd < 0 || io->io_efd < 0) {
+        perror ("eventfd");
+        exit (1);
+    }
+    for (i = 0; i < IO_RING; i++) {
+        io->frees[i] = pkt_alloc ();
+        io->txs[i].pkt = xmalloc (pkt_size);
+    }
+    io->free.head = IO_RING;
+    if ((err = pthread_create (&io->thread, NULL, io_main, io))) {
+        errno = err;
+        perror ("pthread_create");
+        exit (1);
+    }
+    iot = io;
 }
 
+/* Set up the calling thread's event loop */
+static void
+loop_init (const struct config_common *c)
+{
+    wheel_init ();
+    rx_alloc (c->batch);
+    if (c->send_batch)
+        tx_alloc (c->send_batch);
+    if (opt_poll)
+        use_epoll = 0;
+#if USE_EPOLL
+    if (use_epoll)
+        ev_init ();
+#endif /* USE_EPOLL */
+    if (opt_stats)
+        stats_listen (opt_stats);
+}
 
 void
 do_client (struct config_client *cc)
 {
-    conn_mkevents ();
+    loop_init (&cc->c);
     make_async (cc->listen_socket);
-    cevents[0].fd = cc->listen_socket;
-    cevents[0].events = POLLIN;
+    conn_listen (cc->listen_socket);
     for (;;) {
         conn_poll (&cc->c);
-        if (cevents[0].revents) {
+        if (listen_ready) {
             struct sockaddr_storage ss;
             socklen_t len = sizeof (ss);
             int s, u;
@@ -861,13 +2879,13 @@ do_client (struct config_client *cc)
                 continue;
             make_async (s);
             if ((u = connect_to (1, &cc->server)) >= 0) {
-                c = conn_alloc ();
+                c = conn_alloc (&cc->c);
                 c->rfd = s;
                 c->wfd = s;
                 c->nfd = u;
                 c->peer = cc->server;
                 c->rel = rel_create (c, NULL, &cc->c);
-                conn_mkevents ();
+                conn_register (c);
             }
             else
                 close (s);
@@ -879,24 +2897,121 @@ void
 do_server (struct config_server *cs)
 {
     serverconf = cs;
-    conn_mkevents ();
+    loop_init (&cs->c);
     make_async (cs->udp_socket);
-    cevents[0].fd = cs->udp_socket;
-    cevents[0].events = POLLIN;
+    if (opt_iothread) {
+        io_start (&cs->c, cs->udp_socket, 1);
+        conn_listen (iot->loop_efd);
+    }
+    else
+        conn_listen (cs->udp_socket);
     for (;;) {
         conn_poll (&cs->c);
-        if (cevents[0].revents)
+        if (listen_ready && iot)
+            io_demux ();
+        else if (listen_ready)
             conn_demux (cs);
+        if (listen_ready)
+            conn_reap ();
+    }
+}
+
+struct shard {
+    struct config_server cs;	/* udp_socket is this shard's own */
+    pthread_t thread;
+    int cpu;			/* pin to this CPU, or -1 */
+};
+static struct shard *shards;
+
+static void *
+shard_main (void *_sh)
+{
+    struct shard *sh = _sh;
+    
+    shard_id = sh - shards;
+    pthread_sigmask (SIG_BLOCK, NULL, &wait_set);
+    sigdelset (&wait_set, SIGWAKE);
+    wait_mask = &wait_set;
+    if (sh->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO (&set);
+        CPU_SET (sh->cpu, &set);
+        if ((errno = pthread_setaffinity_np (pthread_self (),
+                                             sizeof (set), &set)))
+            perror ("pthread_setaffinity_np");
+    }
+    do_server (&sh->cs);
+    return NULL;
+}
+
+/* Run nshards copies of do_server, each in its own thread on its own
+ * SO_REUSEPORT socket bound to ss.  The kernel picks the socket for a
+ * datagram by hashing its addresses and ports, so all of a client's
+ * packets, and hence its connection, stay with one shard.  If pin,
+ * shards go on the CPUs we may run on, round-robin. */
+static void
+do_shards (struct config_server *cs, struct sockaddr_storage *ss,
+           int nshards, int pin)
+{
+    struct shard *sh = shards = xmalloc (nshards * sizeof (*sh));
+    cpu_set_t allowed;
+    struct sigaction sa;
+    sigset_t set;
+    int i, sig, cpu = -1;
+    
+    if (pin && sched_getaffinity (0, sizeof (allowed), &allowed) < 0) {
+        perror ("sched_getaffinity");
+        pin = 0;
+    }
+    for (i = 0; i < nshards; i++) {
+        sh[i].cs = *cs;
+        if ((sh[i].cs.udp_socket = listen_on_opt (1, ss, 1)) < 0)
+            exit (1);
+        sh[i].cpu = -1;
+        if (pin) {
+            do
+                cpu = (cpu + 1) % CPU_SETSIZE;
+            while (!CPU_ISSET (cpu, &allowed));
+            sh[i].cpu = cpu;
+        }
     }
+    
+    /* The shards start with both blocked (see wait_mask) */
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = wake_signal;
+    sigaction (SIGWAKE, &sa, NULL);
+    sigemptyset (&set);
+    sigaddset (&set, SIGUSR1);
+    sigaddset (&set, SIGWAKE);
+    pthread_sigmask (SIG_BLOCK, &set, NULL);
+    for (i = 0; i < nshards; i++)
+        if ((errno = pthread_create (&sh[i].thread, NULL,
+                                     shard_main, &sh[i]))) {
+            perror ("pthread_create");
+            exit (1);
+        }
+    
+    /* The shards never return; all that is left here is SIGUSR1 */
+    sigdelset (&set, SIGWAKE);
+    for (;;)
+        if (sigwait (&set, &sig) == 0) {
+            stats_requests++;
+            for (i = 0; i < nshards; i++)
+                pthread_kill (sh[i].thread, SIGWAKE);
+        }
 }
 
 static void
 usage (void)
 {
     fprintf (stderr,
-             "usage: %s udp-port [host:]udp-port\n"
-             "       %s -c {-u unix-socket | tcp-port} [host:]udp-port\n"
-             "       %s -s [-u] udp-port {unix-socket | [host:]tcp-port}\n"
+             "usage: %s [-G] [-H] [-I] [-m max-packet] [-M stats-socket]"
+             " udp-port [host:]udp-port\n"
+             "       %s -c [-G] [-H] [-m max-packet] [-M stats-socket]"
+             " {-u unix-socket | tcp-port} [host:]udp-port\n"
+             "       %s -s [-u] [-G] [-H] [-I] [-T threads [-K]] [-m max-packet]"
+             " [-M stats-socket] udp-port"
+             " {unix-socket | [host:]tcp-port}\n"
              , progname, progname, progname);
     exit (1);
 }
@@ -910,12 +3025,32 @@ main (int argc, char **argv)
         { "server", no_argument, NULL, 's' },
         { "window", required_argument, NULL, 'w' },
         { "client", no_argument, NULL, 'c' },
+        { "dupacks", required_argument, NULL, 'D' },
+        { "sack", no_argument, NULL, 'S' },
+        { "cc", required_argument, NULL, 'C' },
+        { "batch", required_argument, NULL, 'b' },
+        { "send-batch", required_argument, NULL, 'q' },
+        { "poll", no_argument, NULL, 'P' },
+        { "outbuf", required_argument, NULL, 'o' },
+        { "nodelay", no_argument, NULL, 'N' },
+        { "ack-every", required_argument, NULL, 'a' },
+        { "ack-delay", required_argument, NULL, 'A' },
+        { "threads", required_argument, NULL, 'T' },
+        { "pin-cpus", no_argument, NULL, 'K' },
+        { "io-thread", no_argument, NULL, 'I' },
+        { "stats", required_argument, NULL, 'M' },
+        { "trace", required_argument, NULL, 'X' },
+        { "hugepages", no_argument, NULL, 'H' },
+        { "max-packet", required_argument, NULL, 'm' },
+        { "no-gso", no_argument, NULL, 'G' },
         { NULL, 0, NULL, 0 }
     };
     int opt;
     int opt_unix = 0;
     int opt_client = 0;
     int opt_server = 0;
+    int opt_threads = 1;
+    int opt_pin = 0;
     char *local = NULL;
     char *remote = NULL;
     struct config_common c;
@@ -926,10 +3061,22 @@ main (int argc, char **argv)
     memset (&sa, 0, sizeof (sa));
     sa.sa_handler = SIG_IGN;
     sigaction (SIGPIPE, &sa, NULL);
+    /* SIGUSR1 dumps the stats to stderr */
+    sa.sa_handler = stats_signal;
+    sigaction (SIGUSR1, &sa, NULL);
+    
+    addrhash_init ();
     
     memset (&c, 0, sizeof (c));
     c.window = 1;
     c.timeout = 2000;
+    c.dupack_threshold = 3;
+    c.congestion = CC_NEWRENO;
+    c.batch = 32;
+    c.outbuf = 0;		/* 8192, or two of the largest packets */
+    c.max_packet = sizeof (packet_t);
+    c.ack_every = 1;
+    c.ack_delay = 40;
     
     progname = strrchr (argv[0], '/');
     if (progname)
@@ -937,7 +3084,7 @@ main (int argc, char **argv)
     else
         progname = argv[0];
     
-    while ((opt = getopt_long (argc, argv, "cdust:w:l", o, NULL)) != -1)
+    while ((opt = getopt_long (argc, argv, "cdust:w:lD:SC:b:q:Po:Na:A:T:KIM:X:Hm:G", o, NULL)) != -1)
         switch (opt) {
             case 'c':
                 opt_client = 1;
@@ -970,16 +3117,94 @@ main (int argc, char **argv)
             case 't':
                 c.timeout = atoi (optarg);
                 break;
+            case 'D':
+                c.dupack_threshold = atoi (optarg);
+                break;
+            case 'S':
+                c.sack = 1;
+                break;
+            case 'b':
+                c.batch = atoi (optarg);
+                break;
+            case 'q':
+                c.send_batch = atoi (optarg);
+                break;
+            case 'T':
+                opt_threads = atoi (optarg);
+                break;
+            case 'K':
+                opt_pin = 1;
+                break;
+            case 'I':
+                opt_iothread = 1;
+                break;
+            case 'M':
+                opt_stats = optarg;
+                break;
+            case 'X':
+                opt_trace = optarg;
+                opt_debug = 1;
+                break;
+            case 'H':
+                opt_hugepages = 1;
+                break;
+            case 'm':
+                c.max_packet = atoi (optarg);
+                break;
+            case 'G':
+                udp_gso = 0;
+                break;
+            case 'a':
+                c.ack_every = atoi (optarg);
+                break;
+            case 'A':
+                c.ack_delay = atoi (optarg);
+                break;
+            case 'N':
+                c.nodelay = 1;
+                break;
+            case 'o':
+                c.outbuf = atoi (optarg);
+                break;
+            case 'P':
+                opt_poll = 1;	/* plain poll even where epoll exists */
+                break;
+            case 'C':
+                if (!strcmp (optarg, "none"))
+                    c.congestion = CC_NONE;
+                else if (!strcmp (optarg, "newreno"))
+                    c.congestion = CC_NEWRENO;
+                else if (!strcmp (optarg, "vegas"))
+                    c.congestion = CC_VEGAS;
+                else
+                    usage ();
+                break;
             default:
                 usage ();
                 break;
         }
     
+    if (!c.outbuf)
+        c.outbuf = 2 * c.max_packet > 8192 ? 2 * c.max_packet : 8192;
     if (optind + 2 != argc || c.window < 1 || c.timeout < 10
+        || c.dupack_threshold < 0 || c.batch < 1
+        || c.send_batch < 0 || c.outbuf < c.max_packet
+        || c.max_packet < (int) sizeof (packet_t) || c.max_packet > 65507
+        || c.ack_every < 1 || c.ack_delay < 1
+        || opt_threads < 1 || (opt_threads > 1 && !opt_server)
+        || (opt_iothread && opt_client)
         || (opt_server && opt_client)
         || (!(opt_server || opt_client) && opt_unix))
         usage ();
     c.timer = c.timeout / 5;
+    pkt_size = c.max_packet;
+    opt_pmtud = c.max_packet > (int) sizeof (packet_t);
+    udp_bufsize = (long) c.window * c.max_packet > INT_MAX / 2
+        ? INT_MAX / 2 : c.window * c.max_packet;
+    if (udp_gso)
+        gso_probe ();
+    if (opt_debug)
+        trace_init ();
     local = argv[optind];
     remote = argv[optind+1];
     
@@ -987,8 +3212,11 @@ main (int argc, char **argv)
         struct config_server cs;
         cs.c = c;
         if (get_address (&cs.dest, 0, 0, opt_unix ? AF_UNIX : AF_INET, remote) < 0
-            || get_address (&ss, 1, 1, AF_INET, local) < 0
-            || (cs.udp_socket = listen_on (1, &ss)) < 0)
+            || get_address (&ss, 1, 1, AF_INET, local) < 0)
+            exit (1);
+        if (opt_threads > 1)
+            do_shards (&cs, &ss, opt_threads, opt_pin);
+        if ((cs.udp_socket = listen_on (1, &ss)) < 0)
             exit (1);
         do_server (&cs);
     }
@@ -1004,7 +3232,7 @@ main (int argc, char **argv)
     }
     else {
         struct sockaddr_storage sl, sr;
-        conn_t *cn = conn_alloc ();
+        conn_t *cn = conn_alloc (&c);
         c.single_connection = 1;
         cn->rfd = 0;
         cn->wfd = 1;
@@ -1021,11 +3249,21 @@ main (int argc, char **argv)
         make_async (cn->rfd);
         make_async (cn->wfd);
         make_async (cn->nfd);
+        loop_init (&c);
+        if (opt_iothread) {
+            io_start (&c, cn->nfd, 0);
+            conn_listen (iot->loop_efd);
+        }
         cn->rel = rel_create (cn, NULL, &c);
         
-        conn_mkevents ();
-        while (conn_list)
+        conn_register (cn);
+        while (conn_list) {
             conn_poll (&c);
+            if (listen_ready) {
+                io_demux ();
+                conn_reap ();
+            }
+        }
     }
     
     return 0;
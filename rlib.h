@@ -4,6 +4,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* -----------------------------------------------------------------------
 
@@ -61,6 +62,44 @@
    unacknowledged Data frame with less than the maximum number of
    packets (500), somewhat like TCP's Nagle algorithm.
 
+   Selective acknowledgement (SACK) extension:
+
+   Because receivers go by the len field and must ignore any padding
+   after it, a peer run with --sack may append a sack_ext block to the
+   8 bytes of an Ack packet.  The len field still says 8, so peers
+   that don't know about the extension see an ordinary, padded Ack.
+   The block has its own checksum (computed like the packet's, over
+   the block only) and magic number, and lists up to MAX_SACK_BLOCKS
+   ranges of sequence numbers above ackno that the receiver already
+   holds.  A sender only uses the ranges when it was started with
+   --sack itself and the block validates, and then retransmits just
+   the holes between them.
+
+   Large packet extension:
+
+   A peer run with -m appends a pmtu_ext block to its Ack packets,
+   after the sack_ext if there is one, saying how large a packet it
+   accepts.  Like the SACK block it is padding to other peers, and it
+   has its own checksum and magic number.  A sender that was started
+   with -m itself and sees one searches for the largest packet the
+   path delivers, up to the smaller of the two limits.  It sends
+   probes: Ack packets padded out to the size being tried, whose
+   pmtu_ext gives that size in probe.  The receiver answers each probe
+   that arrives whole at once, with an Ack whose pmtu_ext repeats the
+   size in probe_ack.  Data packets may then be as large as the
+   largest answered probe.  Probes are not duplicate acks, and neither
+   are their answers.  A peer that never sends the block only ever
+   gets packets of at most 512 bytes.
+
+   Delayed ack extension:
+
+   A peer run with ack_every above 1 (see below) may hold an ack back
+   for up to ack_delay ms, which the other side would see as that much
+   extra round trip.  So its Ack packets carry an ackdelay_ext block,
+   last, after any sack_ext and pmtu_ext, giving ack_delay.  A sender
+   that sees one keeps its retransmission timeout at least that much
+   above its usual floor, so a held ack isn't taken for a loss.
+
  */
 
 
@@ -80,6 +119,47 @@ struct packet {
 };
 typedef struct packet packet_t;
 
+#define SACK_MAGIC 0x5341	/* "SA" */
+#define MAX_SACK_BLOCKS 4
+
+/* Received seqnos start through end - 1 */
+struct sack_block {
+  uint32_t start;
+  uint32_t end;
+};
+
+/* Appended after the len bytes of an Ack packet, see above.  Only the
+ * first nblocks blocks are sent. */
+struct sack_ext {
+  uint16_t cksum;
+  uint16_t magic;
+  uint8_t nblocks;
+  uint8_t pad[3];
+  struct sack_block blocks[MAX_SACK_BLOCKS];
+};
+
+#define PMTU_MAGIC 0x504d	/* "PM" */
+
+/* Appended to an Ack packet, see above */
+struct pmtu_ext {
+  uint16_t cksum;
+  uint16_t magic;
+  uint16_t max_packet;		/* Largest packet the sender accepts */
+  uint16_t probe;		/* This datagram's size if it is a probe */
+  uint16_t probe_ack;		/* Size of the probe this answers */
+  uint16_t pad;
+};
+
+#define ACKDELAY_MAGIC 0x4144	/* "AD" */
+
+/* Appended to an Ack packet, see above */
+struct ackdelay_ext {
+  uint16_t cksum;
+  uint16_t magic;
+  uint16_t delay;		/* Longest the sender holds an ack, in ms */
+  uint16_t pad;
+};
+
 /* -----------------------------------------------------------------------
 
    Important notes about the library:
@@ -109,10 +189,41 @@ typedef struct packet packet_t;
                   CLOCK_MONOTONIC useful for keeping track of when
                   packets are sent.  Run "man clock_gettime".
 
+       - dupack_threshold: How many duplicate acks for the same
+                  packet mean it was lost and should be resent right
+                  away, without waiting for its timeout (default 3).
+
+       - congestion: Which congestion control algorithm to run
+                  (CC_NEWRENO unless -C says otherwise).
+
+       - nodelay: When set, send each short packet as soon as there
+                  is input for it, instead of holding it back while
+                  another short packet is unacknowledged (see above).
+
+       - ack_every, ack_delay: A receiver may hold back the ack for
+                  an in-order packet until ack_every of them have
+                  arrived or the oldest has waited ack_delay ms.
+                  Anything else (duplicates, out-of-order packets,
+                  output space opening up) is acked at once.  With
+                  ack_every 1 (the default), every packet is acked.
+                  An ack_every above window counts as window.
+
+       - outbuf:  How many bytes conn_output will hold for a
+                  connection whose output can't keep up; this is
+                  what conn_bufspace counts down from (default 8192,
+                  or twice max_packet if that is more).
+
+       - max_packet: The largest packet to send or accept, when the
+                  peer agrees and the path carries it (see the large
+                  packet extension above).  sizeof (packet_t) unless
+                  -m says otherwise.  Packets passed to rel_recvpkt
+                  have room for this many bytes, even though packet_t
+                  only declares 500 bytes of data.
+
    * Your task is to implement the following seven functions:
 
        rel_create, rel_destroy, rel_recvpkt, rel_demux,
-       rel_read, rel_output, rel_timer
+       rel_read, rel_output, rel_stats
 
      as well to augment the reliable_state data structure.  All the
      changes you need to make are in the file reliable.c.
@@ -171,31 +282,62 @@ typedef struct packet packet_t;
      point you can send out more Acks to get more data from the remote
      side.
 
-   * The function rel_timer is called periodically, currently at a
-     rate 1/5 of the retransmission interval.  You can use this timer
-     to inspect packets and retransmit packets that have not been
-     acknowledged.  Do not retransmit every packet every time the
-     timer is fired!  You must keep track of which packets need to be
-     retransmitted when.
+   * There is no periodic tick.  Instead, set a timer (see timer_set
+     below) for each thing that has a deadline: one per packet in
+     flight for its retransmission, or one for an ack you are
+     delaying.  The library calls the timer's function once the
+     deadline passes, and sleeps until the next deadline comes up (or
+     indefinitely if there is none), so idle connections cost
+     nothing.  Cancel a timer when what it was for has happened, and
+     always before freeing the memory it lives in.
 
 */
 
 struct config_common {
   int window;			/* # of unacknowledged packets in flight */
-  int timer;			/* How often rel_timer called in milliseconds */
+  int timer;			/* Retry interval, in milliseconds, for work a
+				   timer had to put off */
   int timeout;			/* Retransmission timeout in milliseconds */
   int single_connection;        /* Exit after first connection failure */
+  int dupack_threshold;		/* Duplicate acks that trigger a fast
+				   retransmit, 0 to disable */
+  int sack;			/* Send and use SACK blocks on Acks */
+  int congestion;		/* CC_NONE, CC_NEWRENO or CC_VEGAS */
+  int batch;			/* Max datagrams received per system call */
+  int send_batch;		/* Queue up to this many sends per sendmmsg,
+				   0 to send each packet immediately */
+  int outbuf;			/* Bytes of output buffered per connection */
+  int nodelay;			/* Don't hold back short packets (Nagle) */
+  int ack_every;		/* Ack every this many in-order packets */
+  int ack_delay;		/* ...or after this many ms, if sooner */
+  int max_packet;		/* Largest packet to send or accept, if the
+				   peer agrees; sizeof (packet_t) if not */
 };
 
+/* Congestion control algorithms for config_common.congestion.  The
+ * sender never has more than min(cwnd, window) packets in flight. */
+#define CC_NONE    0		/* static window */
+#define CC_NEWRENO 1		/* AIMD with NewReno fast recovery */
+#define CC_VEGAS   2		/* delay-based */
+
 typedef struct reliable_state rel_t;
 
 extern char *progname;		/* Set to name of program by main */
-extern int opt_debug;		/* When != 0, print packets */
+extern int opt_debug;		/* When != 0, keep the packet trace */
 
 #if !DMALLOC
 void *xmalloc (size_t);
 #endif /* !DMALLOC */
+/* Allocate from the event loop's slab, for memory that comes and goes
+ * with connections and whose size is the same for all of them.  Free
+ * with the same n, on the same thread. */
+void *slab_alloc (size_t n);
+void slab_free (void *p, size_t n);
 uint16_t cksum (const void *_data, int len); /* compute TCP-like checksum */
+/* Given the cksum of some data, return what it becomes when the len
+ * bytes at old (an even offset into the data, len even) change to the
+ * bytes at new, without summing the rest again (RFC 1624). */
+uint16_t cksum_update (uint16_t sum, const void *old, const void *new, int len);
 
 
 /* Returns 1 when two addresses equal, 0 otherwise */
@@ -203,7 +345,8 @@ int addreq (const struct sockaddr_storage *a, const struct sockaddr_storage *b);
 
 /* Hash a socket address down to a number.  Multiple addresses may
    hash to the same number, and the hash value is not guaranteed to be
-   the same on different machines, but this may be useful for
+   the same on different machines (or even different runs: it is keyed
+   with a random per-process secret), but this may be useful for
    implementing a hash table. */
 unsigned int addrhash (const struct sockaddr_storage *s);
 
@@ -224,6 +367,10 @@ conn_t *conn_create (rel_t *, const struct sockaddr_storage *);
 
 /* Call this function to send a UDP packet to the other side. */
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
+/* The same, but the datagram goes out at once and by itself, never
+ * batched or segmented with others.  For probes, whose size is the
+ * point. */
+int conn_sendprobe (conn_t *c, const packet_t *pkt, size_t len);
 
 /* This function tells you how many bytes of output buffering are free
  * for conn_output to store your data.  conn_output is guaranteed not
@@ -243,6 +390,13 @@ size_t conn_bufspace (conn_t *c);
  * write. */
 int conn_output (conn_t *c, const void *buf, size_t len);
 
+/* Like conn_output, but hands over the iovcnt buffers in iov together,
+ * in as few system calls as possible.  This is the way to deliver a
+ * run of in-order packets.  Returns the total number of bytes taken
+ * (which may again be fewer than asked for), or -1 on error.  It can't
+ * send an EOF; use conn_output for that. */
+int conn_outputv (conn_t *c, const struct iovec *iov, int iovcnt);
+
 /* Get some input from the reliable side.  You must must then put the
  * data into UDP sockets which you send out with conn_sendpkt.  This
  * function returns the number of bytes received, 0 if there is no
@@ -252,6 +406,42 @@ int conn_input (conn_t *c, void *buf, size_t len);
 /* Deallocate a connection */
 void conn_destroy (conn_t *c);
 
+/* A one-shot timer.  Embed one in your own state for each deadline,
+ * timer_init it once, then timer_set and timer_cancel it as often as
+ * you like.  fn gets the timer back; use offsetof to find the structure
+ * around it.  The fields are the library's. */
+struct timer {
+  struct timer *next;
+  struct timer **prev;		/* NULL when not pending */
+  uint64_t expires;		/* in ms, on the CLOCK_MONOTONIC scale */
+  int slot;
+  void (*fn) (struct timer *);
+};
+void timer_init (struct timer *t, void (*fn) (struct timer *));
+/* Call t->fn ms milliseconds from now, instead of whenever it was set
+ * to go off before. */
+void timer_set (struct timer *t, long ms);
+void timer_cancel (struct timer *t);
+/* The CLOCK_MONOTONIC time in ms, as of when the loop last woke up.
+ * All timers that fire in one go see the same value. */
+uint64_t timer_now (void);
+/* The same clock reading in microseconds, for timing round trips */
+uint64_t timer_now_us (void);
+
+/* Record an event (one of the TR_ types in trace.h) in the packet
+ * trace, if -d turned it on.  It costs a clock read, no formatting.
+ * c may be NULL if the packet has no connection; seqno and ackno are
+ * in host byte order. */
+void conn_trace (conn_t *c, int type, uint32_t seqno, uint32_t ackno, int len);
+
+/* The packet passed to rel_recvpkt or rel_demux is only valid until
+ * that function returns.  To keep it longer without copying it (say,
+ * until it can be delivered in order), call pkt_hold on it, and
+ * pkt_release once you are done.  Only use these on packets the
+ * library gave you. */
+packet_t *pkt_hold (packet_t *pkt);
+void pkt_release (packet_t *pkt);
+
 /* Functions you must provide (in reliable.c). */
 
 rel_t *rel_create (conn_t *, const struct sockaddr_storage *,
@@ -268,7 +458,22 @@ void rel_demux (const struct config_common *cc,
 /* Notification handlers */
 int rel_read (rel_t *);    /* Invoked when you can call conn_input */
 void rel_output (rel_t *);  /* Invoked when some output drained */
-void rel_timer (void); /* Invoked roughly each timer/5 milliseconds */
+
+/* Counters a connection keeps for the stats dump (-M, or SIGUSR1).
+ * The library counts what it sends and delivers itself. */
+struct rel_stats {
+  uint64_t pkts_recv;		/* Datagrams passed to rel_recvpkt */
+  uint64_t bytes_recv;
+  uint64_t retransmits;		/* Data packets sent again */
+  uint64_t cksum_errors;	/* Datagrams dropped as corrupt */
+  uint64_t duplicates;		/* Data packets already received */
+  uint64_t out_of_order;	/* Data packets buffered behind a hole */
+  int window;			/* Packets the sender may have in flight */
+  long srtt;			/* Smoothed RTT in microseconds, 0 if none yet */
+  int max_packet;		/* Largest data packet we send now */
+};
+/* Fill in *s for r; called only when a dump is asked for. */
+void rel_stats (rel_t *r, struct rel_stats *s);
 
 
 
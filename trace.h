@@ -0,0 +1,45 @@
+/* Binary packet trace, shared by rlib.c (which records it) and
+ * tracedump.c (which decodes it).
+ *
+ * With -d, every packet event goes into a fixed ring of TRACE_RING
+ * records in memory: no formatting and no system calls beyond reading
+ * the clock.  The ring is dumped on SIGUSR2, on SIGINT or SIGTERM, and
+ * at exit.  A dump is a trace_hdr followed by the whole ring, so only
+ * the last TRACE_RING events survive. */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_ 1
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "RLTRACE1"
+#define TRACE_RING 65536	/* records; power of 2 */
+
+/* Event types */
+#define TR_SEND       1		/* datagram handed to the network */
+#define TR_RECV       2		/* datagram the protocol accepted */
+#define TR_RETRANSMIT 3		/* data packet sent again */
+#define TR_DROP       4		/* corrupt, duplicate or out of window */
+#define TR_DELIVER    5		/* payload handed to conn_output */
+
+struct trace_rec {
+  uint64_t ns;			/* CLOCK_MONOTONIC */
+  uint32_t conn;		/* connection id, 0 if not known yet */
+  uint32_t seqno;		/* 0 for acks */
+  uint32_t ackno;
+  uint16_t len;			/* packet length (payload for TR_DELIVER) */
+  uint8_t type;			/* TR_* */
+  uint8_t shard;		/* -T shard, 0 without */
+};
+
+struct trace_hdr {
+  char magic[8];		/* TRACE_MAGIC, not NUL-terminated */
+  uint32_t rec_size;		/* sizeof (struct trace_rec) */
+  uint32_t ring_size;		/* TRACE_RING */
+  uint64_t head;		/* records ever written; record i is
+				   in slot i % ring_size */
+  uint64_t mono_ns;		/* CLOCK_MONOTONIC when dumped */
+  uint64_t real_ns;		/* CLOCK_REALTIME when dumped */
+};
+
+#endif /* !_TRACE_H_ */
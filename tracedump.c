@@ -0,0 +1,209 @@
+/* Decode a packet trace written by reliable -d (see trace.h).
+ *
+ *   tracedump trace-file        one line per event, oldest first
+ *   tracedump -s trace-file     totals per event type and connection
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#include <inttypes.h>
+#include "trace.h"
+
+char *progname;
+
+static const char *const type_names[] = {
+  "?", "send", "recv", "retransmit", "drop", "deliver"
+};
+#define NTYPES (sizeof (type_names) / sizeof (type_names[0]))
+
+static const char *
+type_name (int type)
+{
+  return type > 0 && type < NTYPES ? type_names[type] : type_names[0];
+}
+
+struct conn_total {
+  uint8_t shard;
+  uint32_t conn;
+  uint64_t events[NTYPES];
+  uint64_t bytes_sent;
+  uint64_t bytes_delivered;
+  uint64_t first_ns, last_ns;
+};
+
+static int
+conn_total_cmp (const void *_a, const void *_b)
+{
+  const struct conn_total *a = _a, *b = _b;
+  if (a->shard != b->shard)
+    return a->shard < b->shard ? -1 : 1;
+  if (a->conn != b->conn)
+    return a->conn < b->conn ? -1 : 1;
+  return 0;
+}
+
+static void
+print_event (const struct trace_hdr *h, const struct trace_rec *t)
+{
+  /* Put wall-clock time on it by way of the two clocks at dump time */
+  uint64_t real = h->real_ns - (h->mono_ns - t->ns);
+  time_t sec = real / 1000000000;
+  struct tm tm;
+  char when[32];
+
+  localtime_r (&sec, &tm);
+  strftime (when, sizeof (when), "%H:%M:%S", &tm);
+  printf ("%s.%06u %-10s %u/%-5u seq %-10" PRIu32 " ack %-10" PRIu32
+          " len %u\n", when, (unsigned) (real % 1000000000 / 1000),
+          type_name (t->type), t->shard, t->conn, t->seqno, t->ackno, t->len);
+}
+
+static void
+summarize (const struct trace_rec *recs, size_t n)
+{
+  struct conn_total *totals = NULL;
+  size_t ntotals = 0, i, j;
+  uint64_t events[NTYPES];
+
+  memset (events, 0, sizeof (events));
+  for (i = 0; i < n; i++) {
+    const struct trace_rec *t = &recs[i];
+    struct conn_total *ct;
+    int type = t->type < NTYPES ? t->type : 0;
+
+    events[type]++;
+    for (j = 0; j < ntotals; j++)
+      if (totals[j].shard == t->shard && totals[j].conn == t->conn)
+        break;
+    if (j == ntotals) {
+      totals = realloc (totals, ++ntotals * sizeof (*totals));
+      if (!totals) {
+        perror ("realloc");
+        exit (1);
+      }
+      memset (&totals[j], 0, sizeof (totals[j]));
+      totals[j].shard = t->shard;
+      totals[j].conn = t->conn;
+      totals[j].first_ns = t->ns;
+    }
+    ct = &totals[j];
+    ct->events[type]++;
+    ct->last_ns = t->ns;
+    if (type == TR_SEND)
+      ct->bytes_sent += t->len;
+    else if (type == TR_DELIVER)
+      ct->bytes_delivered += t->len;
+  }
+
+  printf ("%zu events", n);
+  if (n > 1)
+    printf (" over %.6f s", (recs[n - 1].ns - recs[0].ns) / 1e9);
+  printf ("\n");
+  for (i = 1; i < NTYPES; i++)
+    printf ("  %-10s %" PRIu64 "\n", type_names[i], events[i]);
+  if (events[0])
+    printf ("  %-10s %" PRIu64 "\n", "unknown", events[0]);
+
+  qsort (totals, ntotals, sizeof (*totals), conn_total_cmp);
+  printf ("\n%-9s %9s %9s %9s %9s %9s %7s %12s %12s %10s\n",
+          "conn", "send", "recv", "retrans", "drop", "deliver", "retx%",
+          "bytes_sent", "bytes_out", "seconds");
+  for (i = 0; i < ntotals; i++) {
+    struct conn_total *ct = &totals[i];
+    char name[32];
+    snprintf (name, sizeof (name), "%u/%u", ct->shard, ct->conn);
+    printf ("%-9s %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64
+            " %9" PRIu64 " %7.2f %12" PRIu64 " %12" PRIu64 " %10.6f\n",
+            name, ct->events[TR_SEND], ct->events[TR_RECV],
+            ct->events[TR_RETRANSMIT], ct->events[TR_DROP],
+            ct->events[TR_DELIVER],
+            ct->events[TR_SEND]
+            ? 100.0 * ct->events[TR_RETRANSMIT] / ct->events[TR_SEND] : 0.0,
+            ct->bytes_sent, ct->bytes_delivered,
+            (ct->last_ns - ct->first_ns) / 1e9);
+  }
+  free (totals);
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: %s [-s] trace-file\n", progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct trace_hdr h;
+  struct trace_rec *ring, *recs;
+  uint64_t first, i;
+  size_t n = 0;
+  int opt, opt_summary = 0;
+  FILE *f;
+
+  progname = strrchr (argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  while ((opt = getopt (argc, argv, "s")) != -1)
+    switch (opt) {
+    case 's':
+      opt_summary = 1;
+      break;
+    default:
+      usage ();
+    }
+  if (optind + 1 != argc)
+    usage ();
+
+  if (!(f = fopen (argv[optind], "rb"))) {
+    perror (argv[optind]);
+    exit (1);
+  }
+  if (fread (&h, sizeof (h), 1, f) != 1
+      || memcmp (h.magic, TRACE_MAGIC, sizeof (h.magic))
+      || h.rec_size != sizeof (struct trace_rec)
+      || h.ring_size == 0 || (h.ring_size & (h.ring_size - 1))) {
+    fprintf (stderr, "%s: not a trace file (or from another version)\n",
+             argv[optind]);
+    exit (1);
+  }
+  ring = malloc (h.ring_size * sizeof (*ring));
+  recs = malloc (h.ring_size * sizeof (*recs));
+  if (!ring || !recs) {
+    perror ("malloc");
+    exit (1);
+  }
+  if (fread (ring, sizeof (*ring), h.ring_size, f) != h.ring_size) {
+    fprintf (stderr, "%s: truncated\n", argv[optind]);
+    exit (1);
+  }
+  fclose (f);
+
+  /* Unwrap the ring, oldest first.  A record still being written when
+   * the dump was taken may be missing its type; skip those. */
+  first = h.head > h.ring_size ? h.head - h.ring_size : 0;
+  for (i = first; i < h.head; i++) {
+    const struct trace_rec *t = &ring[i & (h.ring_size - 1)];
+    if (t->type)
+      recs[n++] = *t;
+  }
+  if (first)
+    fprintf (stderr, "[%" PRIu64 " earlier events were overwritten]\n",
+             first);
+
+  if (opt_summary)
+    summarize (recs, n);
+  else
+    for (i = 0; i < n; i++)
+      print_event (&h, &recs[i]);
+  free (ring);
+  free (recs);
+  return 0;
+}